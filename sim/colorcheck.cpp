@@ -0,0 +1,260 @@
+// ---------------------- color calibration check ----------------------
+// reads the samples color calibration recorded (cardsamples.csv, or the
+// sim's sim_sd_cardsamples.csv) and prints how well each classifier sorts
+// them: the fixed hue ranges, the saved centroids if a calibration file is
+// given, and centroids built with each card left out in turn, which is the
+// fair estimate for cards the calibration hasn't seen.
+//   colorcheck sim_sd_cardsamples.csv sim_sd_cardcolors.txt
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+
+// must match the card color section of src/v11.cpp
+const int   COLOR_CLASSES = 5;
+const int   COLOR_FEATURES = 4;
+const float COLOR_MAX_SPREADS = 5.0f;
+const float COLOR_MIN_SPREAD = 0.02f;
+const int   COLOR_EMPTY = 4;
+const int   COLOR_UNKNOWN = 5;
+
+const char *const CLASS_NAMES[COLOR_CLASSES + 1] = {"hearts", "spades", "diamonds", "clubs",
+                                                    "tray", "unknown"};
+
+struct Sample
+{
+  int card;
+  int label;
+  float hue;
+  float f[COLOR_FEATURES];
+};
+
+struct Centroids
+{
+  float mean[COLOR_CLASSES][COLOR_FEATURES];
+  float spread[COLOR_CLASSES];
+};
+
+int hueClass(float hue)
+{
+  if (hue >= 0 && hue < 20) return 0;
+  if (hue >= 20 && hue < 45) return 1;
+  if (hue >= 215 && hue < 360) return 2;
+  if (hue >= 45 && hue <= 150) return 3;
+  if (hue >= 180 && hue < 205) return COLOR_EMPTY;
+  return COLOR_UNKNOWN;
+}
+
+int nearestColor(const Centroids &c, const float *f)
+{
+  int best = 0;
+  float bestD = 1e9f;
+  for (int k = 0; k < COLOR_CLASSES; k++)
+  {
+    float d = 0.0f;
+    for (int j = 0; j < COLOR_FEATURES; j++) d += (f[j] - c.mean[k][j]) * (f[j] - c.mean[k][j]);
+    d = sqrtf(d);
+    if (d < bestD)
+    {
+      best = k;
+      bestD = d;
+    }
+  }
+  if (bestD > COLOR_MAX_SPREADS * fmaxf(c.spread[best], COLOR_MIN_SPREAD)) return COLOR_UNKNOWN;
+  return best;
+}
+
+// same sums as calibrateColors(), leaving out one card (or none with -1)
+bool buildCentroids(const std::vector<Sample> &samples, int leaveOut, Centroids &c)
+{
+  float sumSq[COLOR_CLASSES] = {0.0f};
+  int count[COLOR_CLASSES] = {0};
+  memset(c.mean, 0, sizeof(c.mean));
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    const Sample &s = samples[i];
+    if (s.card == leaveOut) continue;
+    for (int j = 0; j < COLOR_FEATURES; j++)
+    {
+      c.mean[s.label][j] += s.f[j];
+      sumSq[s.label] += s.f[j] * s.f[j];
+    }
+    count[s.label]++;
+  }
+  for (int k = 0; k < COLOR_CLASSES; k++)
+  {
+    if (count[k] == 0) return false;
+    float meanSq = 0.0f;
+    for (int j = 0; j < COLOR_FEATURES; j++)
+    {
+      c.mean[k][j] /= count[k];
+      meanSq += c.mean[k][j] * c.mean[k][j];
+    }
+    c.spread[k] = sqrtf(fmaxf(sumSq[k] / count[k] - meanSq, 0.0f));
+  }
+  return true;
+}
+
+bool loadCentroids(const char *name, Centroids &c)
+{
+  FILE *f = fopen(name, "r");
+  if (!f) return false;
+  bool ok = true;
+  for (int k = 0; k < COLOR_CLASSES && ok; k++)
+  {
+    ok = fscanf(f, "%f %f %f %f %f", &c.mean[k][0], &c.mean[k][1], &c.mean[k][2],
+                &c.mean[k][3], &c.spread[k]) == 5;
+  }
+  fclose(f);
+  return ok;
+}
+
+// rows are the loaded class, columns what the classifier said
+struct Confusion
+{
+  int n[COLOR_CLASSES][COLOR_CLASSES + 1];
+  Confusion() { memset(n, 0, sizeof(n)); }
+
+  void print(const char *title) const
+  {
+    int right = 0, total = 0;
+    printf("%s\n%10s", title, "");
+    for (int k = 0; k <= COLOR_CLASSES; k++) printf(" %8s", CLASS_NAMES[k]);
+    printf("\n");
+    for (int k = 0; k < COLOR_CLASSES; k++)
+    {
+      printf("%10s", CLASS_NAMES[k]);
+      for (int j = 0; j <= COLOR_CLASSES; j++)
+      {
+        printf(" %8d", n[k][j]);
+        total += n[k][j];
+      }
+      right += n[k][k];
+      printf("\n");
+    }
+    printf("accuracy %.1f%% (%d of %d)\n\n", total ? 100.0 * right / total : 0.0, right, total);
+  }
+};
+
+// the class most of a card's samples got
+int majority(const int *votes)
+{
+  int best = COLOR_UNKNOWN;
+  for (int k = 0; k <= COLOR_CLASSES; k++)
+  {
+    if (votes[k] > votes[best]) best = k;
+  }
+  return best;
+}
+
+// per sample, and per card by majority of its samples
+void check(const std::vector<Sample> &samples, int cards, const char *title,
+           int (*classify)(const Sample &, int card, const void *ctx), const void *ctx)
+{
+  Confusion perSample, perCard;
+  std::vector<int> label(cards, -1);
+  std::vector<int> votes(cards * (COLOR_CLASSES + 1), 0);
+  for (size_t i = 0; i < samples.size(); i++)
+  {
+    const Sample &s = samples[i];
+    int got = classify(s, s.card, ctx);
+    perSample.n[s.label][got]++;
+    label[s.card] = s.label;
+    votes[s.card * (COLOR_CLASSES + 1) + got]++;
+  }
+  for (int c = 0; c < cards; c++)
+  {
+    if (label[c] < 0) continue;
+    perCard.n[label[c]][majority(&votes[c * (COLOR_CLASSES + 1)])]++;
+  }
+  char text[128];
+  snprintf(text, sizeof(text), "%s, per sample", title);
+  perSample.print(text);
+  snprintf(text, sizeof(text), "%s, per card", title);
+  perCard.print(text);
+}
+
+int byHue(const Sample &s, int, const void *)
+{
+  return hueClass(s.hue);
+}
+
+int bySaved(const Sample &s, int, const void *ctx)
+{
+  return nearestColor(*(const Centroids *)ctx, s.f);
+}
+
+int byLeftOut(const Sample &s, int card, const void *ctx)
+{
+  return nearestColor(((const Centroids *)ctx)[card], s.f);
+}
+
+int main(int argc, char **argv)
+{
+  if (argc < 2 || argc > 3)
+  {
+    fprintf(stderr, "usage: colorcheck SAMPLES.csv [CALIBRATION.txt]\n");
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1], "r");
+  if (!f)
+  {
+    fprintf(stderr, "colorcheck: can't open %s\n", argv[1]);
+    return 1;
+  }
+  std::vector<Sample> samples;
+  int cards = 0;
+  char line[256];
+  while (fgets(line, sizeof(line), f))
+  {
+    Sample s;
+    float red, green, blue, brightness;
+    if (sscanf(line, "%d,%d,%f,%f,%f,%f,%f", &s.card, &s.label, &red, &green, &blue,
+               &brightness, &s.hue) != 7) continue;  // the header
+    if (s.label < 0 || s.label >= COLOR_CLASSES || s.card < 0) continue;
+    float sum = red + green + blue;
+    if (sum <= 0.0f) sum = 1.0f;
+    s.f[0] = red / sum;
+    s.f[1] = green / sum;
+    s.f[2] = blue / sum;
+    s.f[3] = brightness / 100.0f;
+    samples.push_back(s);
+    if (s.card >= cards) cards = s.card + 1;
+  }
+  fclose(f);
+  if (samples.empty())
+  {
+    fprintf(stderr, "colorcheck: no samples in %s\n", argv[1]);
+    return 1;
+  }
+  printf("%d samples from %d cards\n\n", (int)samples.size(), cards);
+
+  check(samples, cards, "hue ranges", byHue, 0);
+
+  if (argc == 3)
+  {
+    Centroids saved;
+    if (!loadCentroids(argv[2], saved))
+    {
+      fprintf(stderr, "colorcheck: can't read %s\n", argv[2]);
+      return 1;
+    }
+    check(samples, cards, "saved centroids", bySaved, &saved);
+  }
+
+  // a class with a single card (the tray) keeps it, or there'd be nothing left
+  Centroids all;
+  if (!buildCentroids(samples, -1, all))
+  {
+    fprintf(stderr, "colorcheck: every class needs samples\n");
+    return 1;
+  }
+  std::vector<Centroids> leftOut(cards, all);
+  for (int c = 0; c < cards; c++)
+  {
+    if (!buildCentroids(samples, c, leftOut[c])) leftOut[c] = all;
+  }
+  check(samples, cards, "centroids, card left out", byLeftOut, &leftOut[0]);
+  return 0;
+}
@@ -0,0 +1,187 @@
+// ---------------------- flight recorder decoder ----------------------
+// turns the brain's flight.bin (or the sim's sim_sd_flight.bin) into csv on
+// stdout, one row per record, and prints a short summary on stderr,
+// including dealing throughput against battery voltage.
+//   flightlog sim_sd_flight.bin > flight.csv
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// must match the flight recorder section of src/v11.cpp
+const uint32_t LOG_MAGIC   = 0x474F4C46;
+const uint16_t LOG_VERSION = 2;
+
+const uint8_t REC_TURN     = 1;
+const uint8_t REC_TURN_END = 2;
+const uint8_t REC_STROKE   = 3;
+const uint8_t REC_DROPPED  = 4;
+const uint8_t REC_CARD     = 5;
+const uint8_t REC_JAM      = 6;
+
+// throughput against battery voltage, in 0.2 V bins from 6.6 V
+const float VOLT_LOW = 6.6f;
+const float VOLT_BIN = 0.2f;
+const int   NUM_VOLT_BINS = 9;
+const float CARD_BREAK_MS = 5000.0f;
+
+const uint8_t LOG_TIMED_OUT = 1;
+const uint8_t LOG_ESTOP     = 2;
+const uint8_t LOG_SLIP      = 4;
+const uint8_t LOG_DOUBLE    = 8;
+const uint8_t LOG_JAM_STUCK = 16;
+
+struct LogHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t recordSize;
+};
+
+struct LogRecord
+{
+  uint32_t time;
+  uint8_t  type;
+  int8_t   left;
+  int8_t   right;
+  uint8_t  flags;
+  float    v[4];
+};
+
+int main(int argc, char **argv)
+{
+  if (argc != 2)
+  {
+    fprintf(stderr, "usage: flightlog FILE > out.csv\n");
+    return 1;
+  }
+
+  FILE *f = fopen(argv[1], "rb");
+  if (!f)
+  {
+    fprintf(stderr, "flightlog: can't open %s\n", argv[1]);
+    return 1;
+  }
+
+  LogHeader header;
+  if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != LOG_MAGIC)
+  {
+    fprintf(stderr, "flightlog: %s is not a flight log\n", argv[1]);
+    return 1;
+  }
+  if (header.version != LOG_VERSION || header.recordSize != sizeof(LogRecord))
+  {
+    fprintf(stderr, "flightlog: log version %d (%d byte records), expected %d (%d)\n",
+            header.version, header.recordSize, LOG_VERSION, (int)sizeof(LogRecord));
+    return 1;
+  }
+
+  printf("time_ms,record,rotation_deg,track_error_deg,integral,derivative,"
+         "left_pct,right_pct,target_deg,final_error_deg,turn_ms,profile_ms,"
+         "timed_out,estop,stroke_start_deg,stroke_end_deg,stroke_ms,peak_amps,"
+         "dropped,volts,battery_scale,card_heading_deg,card_gap_ms,cards_seen,"
+         "slip,double,jam_deg,jam_lost_ms,jam_amps,jam_nm,jam_refeeds,jam_stuck\n");
+
+  int turnLoops = 0, turns = 0, timeouts = 0, strokes = 0, dropped = 0, cards = 0;
+  int slips = 0, doubles = 0, jams = 0, jamsStuck = 0;
+  double jamMs = 0.0;
+  int binCards[NUM_VOLT_BINS] = {0};
+  double binMs[NUM_VOLT_BINS] = {0.0};
+  uint32_t lastLoop = 0, longestLoop = 0;
+  double loopSum = 0.0;
+  int loopGaps = 0;
+  bool inTurn = false;
+
+  LogRecord r;
+  while (fread(&r, sizeof(r), 1, f) == 1)
+  {
+    if (r.type == REC_TURN)
+    {
+      printf("%u,turn,%.2f,%.3f,%.3f,%.2f,%d,%d,,,,,,,,,,,,,,,,,,,,,,,,\n", r.time,
+             r.v[0], r.v[1], r.v[2], r.v[3], r.left, r.right);
+      // loop period, from one iteration of a turn to the next
+      if (inTurn)
+      {
+        uint32_t gap = r.time - lastLoop;
+        loopSum += gap;
+        loopGaps++;
+        if (gap > longestLoop) longestLoop = gap;
+      }
+      inTurn = true;
+      lastLoop = r.time;
+      turnLoops++;
+    }
+    else if (r.type == REC_TURN_END)
+    {
+      printf("%u,turn_end,,,,,,,%.2f,%.3f,%.0f,%.0f,%d,%d,,,,,,,,,,,,,,,,,,\n", r.time,
+             r.v[0], r.v[1], r.v[2], r.v[3],
+             (r.flags & LOG_TIMED_OUT) ? 1 : 0, (r.flags & LOG_ESTOP) ? 1 : 0);
+      inTurn = false;
+      turns++;
+      if (r.flags & LOG_TIMED_OUT) timeouts++;
+    }
+    else if (r.type == REC_STROKE)
+    {
+      printf("%u,stroke,,,,,,,,,,,,,%.1f,%.1f,%.0f,%.3f,,,,,,%d,%d,%d,,,,,,\n", r.time,
+             r.v[0], r.v[1], r.v[2], r.v[3], r.left,
+             (r.flags & LOG_SLIP) ? 1 : 0, (r.flags & LOG_DOUBLE) ? 1 : 0);
+      strokes++;
+      if (r.flags & LOG_SLIP) slips++;
+      if (r.flags & LOG_DOUBLE) doubles++;
+    }
+    else if (r.type == REC_DROPPED)
+    {
+      printf("%u,dropped,,,,,,,,,,,,,,,,,%.0f,,,,,,,,,,,,,\n", r.time, r.v[0]);
+      dropped += (int)r.v[0];
+      inTurn = false; // the gap isn't a real loop period
+    }
+    else if (r.type == REC_CARD)
+    {
+      printf("%u,card,,,,,,,,,,,,,,,,,,%.2f,%.3f,%.1f,%.0f,,,,,,,,,\n", r.time,
+             r.v[0], r.v[1], r.v[2], r.v[3]);
+      cards++;
+      // a long gap is a menu or a refill, not dealing
+      if (r.v[3] > 0.0f && r.v[3] <= CARD_BREAK_MS)
+      {
+        int bin = (int)((r.v[0] - VOLT_LOW) / VOLT_BIN + 0.001f);
+        if (bin < 0) bin = 0;
+        if (bin >= NUM_VOLT_BINS) bin = NUM_VOLT_BINS - 1;
+        binCards[bin]++;
+        binMs[bin] += r.v[3];
+      }
+    }
+    else if (r.type == REC_JAM)
+    {
+      printf("%u,jam,,,,,,,,,,,,,,,,,,,,,,,,,%.1f,%.0f,%.3f,%.3f,%d,%d\n", r.time,
+             r.v[0], r.v[1], r.v[2], r.v[3], r.left, (r.flags & LOG_JAM_STUCK) ? 1 : 0);
+      jams++;
+      if (r.flags & LOG_JAM_STUCK) jamsStuck++;
+      jamMs += r.v[1];
+    }
+  }
+  fclose(f);
+
+  fprintf(stderr, "%d turns (%d timed out), %d turn loops, %d strokes, %d cards, %d dropped\n",
+          turns, timeouts, turnLoops, strokes, cards, dropped);
+  if (slips > 0 || doubles > 0)
+  {
+    fprintf(stderr, "%d strokes short of cards, %d with a double feed\n", slips, doubles);
+  }
+  if (jams > 0)
+  {
+    fprintf(stderr, "%d jams (%d not cleared), %.0f ms lost, %.0f ms each\n",
+            jams, jamsStuck, jamMs, jamMs / jams);
+  }
+  if (loopGaps > 0)
+  {
+    fprintf(stderr, "turn loop period mean %.1f ms, longest %u ms\n",
+            loopSum / loopGaps, longestLoop);
+  }
+  for (int b = 0; b < NUM_VOLT_BINS; b++)
+  {
+    if (binCards[b] == 0) continue;
+    fprintf(stderr, "%.1f-%.1f V  %4d cards  %5.1f cards/min\n",
+            VOLT_LOW + b * VOLT_BIN, VOLT_LOW + (b + 1) * VOLT_BIN,
+            binCards[b], binCards[b] * 60000.0 / binMs[b]);
+  }
+  return 0;
+}
@@ -0,0 +1,265 @@
+// ---------------------- host stand-in for the VEX IQ2 SDK ----------------------
+// Only the parts of iq2_cpp.h that our firmware uses. Every call goes to the
+// simulator in sim.cpp, which runs the robot on a virtual clock instead of the
+// real brain. Build with the makefile in this folder, not the VEXcode one.
+#ifndef SIM_IQ2_CPP_H_
+#define SIM_IQ2_CPP_H_
+
+#include <stdint.h>
+
+namespace vex {
+
+// ---------------------- units & enums
+enum class timeUnits { sec, msec };
+enum class rotationUnits { deg, rev, raw };
+enum class percentUnits { pct };
+enum class velocityUnits { pct, rpm, dps };
+enum class currentUnits { amp };
+enum class torqueUnits { Nm, InLb };
+enum class voltageUnits { volt, mV };
+enum class directionType { fwd, rev, undefined };
+enum class brakeType { coast, brake, hold, undefined };
+enum class axisType { xaxis, yaxis, zaxis };
+enum class ledState { off, on };
+
+const timeUnits seconds = timeUnits::sec;
+const timeUnits msec = timeUnits::msec;
+const rotationUnits degrees = rotationUnits::deg;
+const rotationUnits deg = rotationUnits::deg;
+const rotationUnits turns = rotationUnits::rev;
+const percentUnits percent = percentUnits::pct;
+const velocityUnits rpm = velocityUnits::rpm;
+const velocityUnits dps = velocityUnits::dps;
+const currentUnits amp = currentUnits::amp;
+const torqueUnits Nm = torqueUnits::Nm;
+const voltageUnits volt = voltageUnits::volt;
+const directionType forward = directionType::fwd;
+const directionType reverse = directionType::rev;
+const brakeType coast = brakeType::coast;
+const brakeType brake = brakeType::brake;
+const brakeType hold = brakeType::hold;
+const axisType xaxis = axisType::xaxis;
+const axisType yaxis = axisType::yaxis;
+const axisType zaxis = axisType::zaxis;
+
+enum {
+  PORT1 = 0, PORT2, PORT3, PORT4, PORT5, PORT6,
+  PORT7, PORT8, PORT9, PORT10, PORT11, PORT12
+};
+
+enum class colorType {
+  none, black, white, red, green, blue, yellow, orange, purple, cyan,
+  transparent, red_violet, violet, blue_violet, blue_green, yellow_green,
+  yellow_orange, red_orange
+};
+
+class color {
+public:
+  color(colorType c = colorType::none) : value(c) {}
+  operator colorType() const { return value; }
+
+  static const color red;
+  static const color green;
+  static const color blue;
+  static const color yellow;
+  static const color orange;
+  static const color purple;
+  static const color cyan;
+  static const color white;
+  static const color black;
+
+private:
+  colorType value;
+};
+
+// ---------------------- time
+void wait(double time, timeUnits units);
+
+class timer {
+public:
+  timer();
+  double time(timeUnits units = timeUnits::msec) const;
+  void clear();
+  void reset() { clear(); }
+  static uint32_t system();
+  static uint64_t systemHighResolution();
+
+private:
+  uint64_t start;
+};
+
+namespace this_thread {
+  void sleep_for(uint32_t ms);
+  void sleep_until(uint32_t ms);
+  void yield();
+}
+
+// cooperative threads; only one runs at a time on the virtual clock
+class thread {
+public:
+  thread() : id(-1) {}
+  thread(int (*callback)(void));
+  thread(void (*callback)(void));
+  thread(int (*callback)(void *), void *arg);
+  void join();
+  void detach() {}
+  void interrupt();
+  bool joinable() const { return id >= 0; }
+  void setPriority(int32_t priority) { (void)priority; } // all equal here
+
+  static const int32_t threadPriorityLow = 1;
+  static const int32_t threadPriorityNormal = 7;
+  static const int32_t threadPriorityHigh = 15;
+
+private:
+  int id;
+};
+
+class mutex {
+public:
+  mutex() : owned(false) {}
+  void lock();
+  bool try_lock();
+  void unlock() { owned = false; }
+
+private:
+  bool owned;
+};
+
+// ---------------------- brain
+class brain {
+public:
+  class lcd {
+  public:
+    void print(const char *format, ...);
+    void setCursor(int row, int col);
+    void clearScreen();
+    void clearLine(int row);
+    void newLine();
+    int row() const { return cursorRow; }
+
+  private:
+    int cursorRow = 1;
+    int cursorCol = 1;
+  };
+
+  class button {
+  public:
+    explicit button(int id) : index(id) {}
+    bool pressing() const;
+    void pressed(void (*callback)(void));
+    void released(void (*callback)(void));
+
+  private:
+    int index;
+  };
+
+  class battery {
+  public:
+    double voltage(voltageUnits units = voltageUnits::volt) const;
+    double current(currentUnits units = currentUnits::amp) const;
+    uint32_t capacity(percentUnits units = percentUnits::pct) const;
+  };
+
+  class sdcard {
+  public:
+    bool isInserted() const;
+    int32_t savefile(const char *name, uint8_t *buffer, int32_t len);
+    int32_t appendfile(const char *name, uint8_t *buffer, int32_t len);
+    int32_t loadfile(const char *name, uint8_t *buffer, int32_t len);
+    bool exists(const char *name);
+    int32_t size(const char *name);
+  };
+
+  brain() : buttonLeft(0), buttonRight(1), buttonCheck(2) {}
+
+  lcd Screen;
+  button buttonLeft;
+  button buttonRight;
+  button buttonCheck;
+  timer Timer;
+  battery Battery;
+  sdcard SDcard;
+
+  [[noreturn]] void programStop(); // ends the session with a report
+};
+
+// ---------------------- devices
+class motor {
+public:
+  motor(int32_t port, bool reverse = false);
+
+  void spin(directionType dir);
+  void spin(directionType dir, double velocity, percentUnits units);
+  void spin(directionType dir, double velocity, velocityUnits units);
+  bool spinToPosition(double rotation, rotationUnits units,
+                      bool waitForCompletion = true);
+  bool spinFor(directionType dir, double rotation, rotationUnits units,
+               bool waitForCompletion = true);
+  void stop();
+  void stop(brakeType mode);
+
+  void setVelocity(double velocity, percentUnits units);
+  void setVelocity(double velocity, velocityUnits units);
+  void setStopping(brakeType mode);
+  void setPosition(double value, rotationUnits units);
+  void setMaxTorque(double value, percentUnits units);
+  void setTimeout(int32_t time, timeUnits units);
+
+  double position(rotationUnits units) const;
+  double velocity(percentUnits units) const;
+  double velocity(velocityUnits units) const;
+  double current(currentUnits units = currentUnits::amp) const;
+  double current(percentUnits units) const;
+  double torque(torqueUnits units = torqueUnits::Nm) const;
+  bool isDone() const;
+  bool isSpinning() const;
+
+private:
+  int32_t port;
+};
+
+class inertial {
+public:
+  inertial(int32_t port = -1) { (void)port; }
+  void calibrate();
+  bool isCalibrating() const;
+  void setHeading(double value, rotationUnits units);
+  void setRotation(double value, rotationUnits units);
+  double heading(rotationUnits units = rotationUnits::deg) const;
+  double rotation(rotationUnits units = rotationUnits::deg) const;
+  double acceleration(axisType axis) const;
+  double gyroRate(axisType axis, velocityUnits units) const;
+};
+
+class optical {
+public:
+  struct rgbc {
+    double red;
+    double green;
+    double blue;
+    double brightness;
+  };
+
+  optical(int32_t port) { (void)port; }
+  double hue() const;
+  double brightness() const;
+  rgbc getRgb() const;
+  bool isNearObject() const;
+  void setLight(ledState state);
+  void setLightPower(double value, percentUnits units);
+};
+
+class touchled {
+public:
+  touchled(int32_t port) { (void)port; }
+  bool pressing() const;
+  void pressed(void (*callback)(void));
+  void released(void (*callback)(void));
+  void setColor(color c);
+  void setBrightness(double value);
+};
+
+} // namespace vex
+
+#endif
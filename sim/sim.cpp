@@ -0,0 +1,1537 @@
+// ---------------------- VEX IQ2 host simulator ----------------------
+// Runs the firmware on Linux against a model of our robot:
+//   - virtual clock: wait() and every sensor read advance simulated time,
+//     nothing ever sleeps for real, so a session runs much faster than real time
+//   - drivetrain: velocity-controlled motors on PORT3/PORT6 with lag, static
+//     friction and battery sag, turning the chassis in place
+//   - IMU: heading / gyro rate sampled every 10 ms with a little noise
+//   - dispenser: roller on PORT1 feeding a tray of cards, OpticalSensor on
+//     PORT4 sees the bottom card (cyan tray when empty), TouchLED on PORT5
+//   - buttons: pressed from a script given on the command line, once the
+//     motors are idle and the main thread is out of any long wait(); their
+//     callbacks run a random few ms later, like the brain's event dispatch
+// At the end it prints cards/minute, turn latency and dispense cycle time.
+#include "iq2_cpp.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+int vexMain(); // the firmware's main(), renamed by the makefile
+
+namespace sim {
+
+// ---------------------- robot model constants
+const int    PORT_LEFT     = vex::PORT3;
+const int    PORT_RIGHT    = vex::PORT6;
+const int    PORT_DISPENSE = vex::PORT1;
+
+const double MOTOR_MAX_DPS   = 720.0;  // 120 rpm smart motor
+const double DRIVE_TAU       = 0.060;  // drivetrain velocity lag (s)
+const double DISPENSE_TAU    = 0.030;  // dispenser velocity lag (s)
+const double BRAKE_TAU       = 0.025;
+const double COAST_TAU       = 0.150;
+const double YAW_PER_WHEEL   = 0.20;   // chassis dps per wheel dps difference
+const double BREAKAWAY_CW    = 5.5;    // % turn effort to start turning
+const double BREAKAWAY_CCW   = 6.5;
+const double KINETIC_PCT     = 3.0;    // % turn effort to keep turning
+const double IMU_PERIOD      = 0.010;
+const double IMU_NOISE_DEG   = 0.05;
+const double IMU_RATE_NOISE  = 0.4;
+const double CARD_EXIT_DEG   = 100.0;  // roller travel that pushes a card out
+const double CARD_DRAG       = 0.5;    // next card is dragged this much after
+const double CARD_FLIGHT_S   = 0.060;  // time between exit and landing
+const double CARD_LOAD_A     = 0.4;    // roller current pushing one card
+const double EDGE_DIP_S      = 0.020;  // optical sees the gap as a card leaves
+const double JAM_AT_DEG      = 60.0;   // a jamming card sticks this far in
+const double JAM_BACK_DEG    = 20.0;   // reversing this far frees the roller...
+const double JAM_CLEAR       = 0.7;    // ...and straightens the card this often
+const double STALL_A         = 1.2;    // roller current stalled at full power
+const double BATTERY_FULL    = 8.2;
+const double BATTERY_EMPTY   = 6.6;
+const double BATTERY_CAP_AS  = 2000.0 * 3.6; // 2000 mAh in amp-seconds
+const double TRAY_HUE        = 192.0;
+const double SUIT_HUE[4]     = { 10.0, 32.0, 265.0, 95.0 };
+const uint64_t POLL_US       = 20;     // cost of one sensor read
+const uint64_t STEP_US       = 1000;   // physics step
+const uint64_t LONG_WAIT_US  = 50000;  // main thread waits this long aren't input waits
+const uint64_t SD_WRITE_US   = 4000;   // sd write holds the cpu this long...
+const uint64_t SD_BYTE_US    = 2;      // ...plus this per byte
+
+// ---------------------- session parameters (command line)
+struct Params
+{
+  std::string script;
+  unsigned seed = 1;
+  int deckSize = 52;
+  double thinkMs = 400.0;      // user reaction time before each press
+  double holdMs = 80.0;        // how long a press is held once seen
+  double callbackMs = 20.0;    // button callbacks run up to this long after
+                               // the press, the brain's event dispatch
+  double limitS = 3600.0;      // hard stop on virtual time
+  double idleExitS = 8.0;      // stop after this long idle with no script
+  double battery = BATTERY_FULL;
+  int seats = 0;               // seat count for landing accuracy, 0 = off
+  double friction = 1.0;       // table friction, 0.5 smooth .. 2 carpet
+  double slipRate = 0.0;       // chance the roller slips on a card
+  double doubleRate = 0.0;     // chance a card drags the next one out too
+  double jamRate = 0.0;        // chance a card jams part way out
+  double hueNoise = 4.0;       // optical hue noise, deg
+  double hueGlitch = 0.0;      // chance a hue read is junk (card moving, glare)
+  double hueShift = 0.0;       // room light: warm light pushes hues up...
+  double lightScale = 1.0;     // ...and brightness with it
+  bool suitLoads = false;      // one suit at a time, for color calibration
+  double suitCycle = 0.0;      // chance the next card is the suit after the last
+  bool sdCard = true;
+  bool verbose = false;
+  bool screen = false;
+};
+
+// ---------------------- state
+struct Motor
+{
+  bool used = false;
+  bool reversed = false;
+  double cmdPct = 50.0;
+  int dir = 1;
+  bool spinning = false;
+  vex::brakeType stopping = vex::brakeType::coast;
+  vex::brakeType stopMode = vex::brakeType::coast;
+  double vel = 0.0;      // dps, logical direction
+  double pos = 0.0;      // deg
+  double posOffset = 0.0;
+  double accel = 0.0;    // dps/s, for current estimate
+  double load = 0.0;     // extra load in amps
+  bool toTarget = false;
+  double target = 0.0;
+  double maxTorquePct = 100.0;
+  double spinStart = -1.0;  // for turn / dispense cycle stats
+  bool reversedInCycle = false;
+};
+
+struct Task
+{
+  int id;
+  uint64_t wake = 0;
+  uint64_t seq = 0;
+  bool done = false;
+  bool interrupted = false;
+  std::condition_variable cv;
+};
+
+struct Press
+{
+  int button;        // 0 left, 1 right, 2 check, 3 touchled
+  double at;         // virtual time for timed presses (T@12.5), else -1
+};
+
+// touchled pressed while motors were running: how long until every motor
+// had been told to stop, and until everything was at rest
+struct EmergencyStop
+{
+  const char *phase;
+  double pressAt;
+  double brakeMs;
+  double restMs;
+};
+
+struct Ejection
+{
+  double time;
+  double heading;
+  double landing;
+  double rate;
+  int suit;
+};
+
+struct Stats
+{
+  std::vector<double> turnMs;
+  std::vector<double> overshoot;
+  std::vector<double> dispenseMs;
+  std::vector<Ejection> cards;
+  int doubleFeeds = 0;
+  int jams = 0;
+  double jammedS = 0.0;    // roller stalled against a jam
+  int presses = 0;
+  std::vector<EmergencyStop> estops;
+  int sdWrites = 0;
+  double sdBytes = 0.0;
+  double sdStallMs = 0.0;  // longest single write
+};
+
+struct State
+{
+  Params p;
+  std::mt19937 rng;
+  std::mt19937 eventRng;  // callback delays, apart so they don't move the deck
+
+  uint64_t now = 0;       // virtual time, us
+  Motor motors[12];
+
+  // chassis / imu
+  double yaw = 0.0;       // true heading, deg (continuous)
+  double yawRate = 0.0;   // dps
+  double imuHeading = 0.0;
+  double imuRate = 0.0;
+  double imuOffset = 0.0; // setHeading / setRotation
+  double rotOffset = 0.0;
+  double imuNextSample = 0.0;
+  double calibrateUntil = -1.0;
+  bool moving = false;
+  double turnStartYaw = 0.0;  // for overshoot: start and furthest point
+  double turnPeak = 0.0;
+
+  // dispenser / tray
+  std::vector<int> deck;  // front is the bottom card
+  double feed = 0.0;
+  double lastDispensePos = 0.0;
+  bool cardDrawn = false;  // fate of the moving card is decided
+  bool slipping = false;   // roller spins on it without moving it
+  bool doubling = false;   // it'll take the next card with it
+  double dipUntil = -1.0;  // optical brightness dip after a card leaves
+  bool jamming = false;    // it'll stick at JAM_AT_DEG
+  bool jamAgain = false;   // backed off but still crooked, sticks again
+  bool stuck = false;      // roller is stalled against it
+  double backedOff = 0.0;  // reverse travel since it stuck
+
+  // battery
+  double charge = 0.0;    // amp-seconds used
+
+  // input
+  std::vector<Press> script;
+  size_t scriptPos = 0;
+  std::vector<Press> timed;   // sorted by time, pressed regardless of idle
+  size_t timedPos = 0;
+  bool estopPending = false;
+  int suitsLoaded = 0;    // -k: suits put in the tray so far
+  int down = -1;          // button currently held
+  bool seen = false;
+  double seenAt = 0.0;
+  double lastRelease = 0.0;
+  double lastActive = 0.0;
+  double busyUntil = 0.0; // end of the main thread's last long wait
+  void (*onPressed[4])(void) = { 0, 0, 0, 0 };
+  void (*onReleased[4])(void) = { 0, 0, 0, 0 };
+  vex::colorType led = vex::colorType::none;
+
+  // scheduler
+  std::mutex big;
+  std::vector<Task *> tasks;
+  int running = 0;
+  uint64_t seq = 0;
+
+  Stats stats;
+  std::chrono::steady_clock::time_point wallStart;
+};
+
+State &state()
+{
+  static State s;
+  return s;
+}
+
+double nowS() { return state().now / 1e6; }
+
+double gauss(double sigma)
+{
+  std::normal_distribution<double> d(0.0, sigma);
+  return d(state().rng);
+}
+
+[[noreturn]] void report(const char *why);
+
+// ---------------------- physics
+double batteryVoltage()
+{
+  State &s = state();
+  double used = s.charge / BATTERY_CAP_AS;
+  double v = s.p.battery - used * (BATTERY_FULL - BATTERY_EMPTY);
+  return v < BATTERY_EMPTY ? BATTERY_EMPTY : v;
+}
+
+double targetVel(Motor &m)
+{
+  if (!m.spinning) return 0.0;
+  double pct = m.cmdPct;
+  if (m.toTarget)
+  {
+    double err = m.target - m.pos;
+    if (fabs(err) < 1.0) return 0.0;
+    pct = fabs(pct);
+    // motor's own position loop slows down on approach
+    double slow = fabs(err) / 30.0 * 100.0;
+    if (slow < pct) pct = slow < 5.0 ? 5.0 : slow;
+    pct = copysign(pct, err);
+    return pct / 100.0 * MOTOR_MAX_DPS;
+  }
+  double headroom = batteryVoltage() / BATTERY_FULL * 100.0;
+  if (pct > headroom) pct = headroom;
+  if (pct < -headroom) pct = -headroom;
+  return m.dir * pct / 100.0 * MOTOR_MAX_DPS;
+}
+
+void stepMotor(Motor &m, double target, double tau, double dt)
+{
+  if (!m.spinning)
+  {
+    if (m.stopMode == vex::brakeType::coast) tau = COAST_TAU;
+    else tau = BRAKE_TAU;
+  }
+  tau *= BATTERY_FULL / batteryVoltage();
+  double prev = m.vel;
+  m.vel += (target - m.vel) * (dt / (tau + dt));
+  m.accel = (m.vel - prev) / dt;
+  m.pos += m.vel * dt;
+}
+
+void stepDrive(double dt)
+{
+  State &s = state();
+  Motor &l = s.motors[PORT_LEFT];
+  Motor &r = s.motors[PORT_RIGHT];
+
+  double tl = targetVel(l);
+  double tr = targetVel(r);
+
+  // turn effort in percent, + is clockwise
+  double turnPct = (tl - tr) / 2.0 / MOTOR_MAX_DPS * 100.0;
+  double sag = BATTERY_FULL / batteryVoltage() * s.p.friction;
+  double breakaway = (turnPct >= 0 ? BREAKAWAY_CW : BREAKAWAY_CCW) * sag;
+
+  if (!s.moving && fabs(turnPct) < breakaway)
+  {
+    tl = 0.0;
+    tr = 0.0;
+  }
+  else if (s.moving && fabs(turnPct) < KINETIC_PCT * sag)
+  {
+    tl = 0.0;
+    tr = 0.0;
+  }
+
+  stepMotor(l, tl, DRIVE_TAU, dt);
+  stepMotor(r, tr, DRIVE_TAU, dt);
+
+  s.yawRate = (l.vel - r.vel) * YAW_PER_WHEEL;
+  s.yaw += s.yawRate * dt;
+  s.moving = fabs(s.yawRate) > 1.0;
+  if (l.spinning && fabs(s.yaw - s.turnStartYaw) > fabs(s.turnPeak)) s.turnPeak = s.yaw - s.turnStartYaw;
+
+  l.load = 0.15 + fabs(l.accel) / 4000.0;
+  r.load = 0.15 + fabs(r.accel) / 4000.0;
+}
+
+void eject(bool doubleFeed)
+{
+  State &s = state();
+  Ejection e;
+  e.time = nowS();
+  e.heading = fmod(fmod(s.yaw, 360.0) + 360.0, 360.0);
+  e.rate = s.yawRate;
+  e.suit = s.deck.front();
+  e.landing = fmod(e.heading + s.yawRate * CARD_FLIGHT_S + 360.0, 360.0);
+  s.stats.cards.push_back(e);
+  if (doubleFeed) s.stats.doubleFeeds++;
+  if (s.p.verbose)
+  {
+    printf("[%9.3f] card %d out at %.1f deg (rate %.1f dps)%s\n",
+           e.time, (int)s.stats.cards.size(), e.heading, e.rate,
+           doubleFeed ? " DOUBLE" : "");
+  }
+  s.deck.erase(s.deck.begin());
+}
+
+void stepDispenser(double dt)
+{
+  State &s = state();
+  Motor &m = s.motors[PORT_DISPENSE];
+  double target = targetVel(m);
+  if (s.stuck && target > 0.0)
+  {
+    // pushing against the jam: no motion, stall current
+    m.vel = 0.0;
+    m.accel = 0.0;
+    m.load = 0.1 + STALL_A * target / MOTOR_MAX_DPS;
+    s.stats.jammedS += dt;
+    return;
+  }
+  stepMotor(m, target, DISPENSE_TAU, dt);
+
+  double d = m.pos - s.lastDispensePos;
+  s.lastDispensePos = m.pos;
+  m.load = 0.1 + fabs(m.accel) / 8000.0;
+  if (s.deck.empty()) return;
+
+  if (d > 0)
+  {
+    // misfeeds are drawn once per card, and only when asked for so the
+    // random sequence of a normal run doesn't change
+    if (!s.cardDrawn)
+    {
+      std::uniform_real_distribution<double> u(0.0, 1.0);
+      s.slipping = s.p.slipRate > 0.0 && u(s.rng) < s.p.slipRate;
+      s.doubling = s.p.doubleRate > 0.0 && u(s.rng) < s.p.doubleRate;
+      s.jamming = s.jamAgain || (s.p.jamRate > 0.0 && u(s.rng) < s.p.jamRate);
+      s.jamAgain = false;
+      s.cardDrawn = true;
+    }
+    if (s.slipping) return;  // free spinning roller, no card load
+    if (s.jamming && s.feed < JAM_AT_DEG && s.feed + d >= JAM_AT_DEG)
+    {
+      s.feed = JAM_AT_DEG;
+      s.stuck = true;
+      s.backedOff = 0.0;
+      s.stats.jams++;
+      if (s.p.verbose) printf("[%9.3f] card jammed\n", nowS());
+      return;
+    }
+
+    m.load += s.doubling ? 2.0 * CARD_LOAD_A : CARD_LOAD_A;
+    s.feed += d;
+    bool first = true;
+    while (!s.deck.empty() && s.feed >= CARD_EXIT_DEG)
+    {
+      double over = s.feed - CARD_EXIT_DEG;
+      eject(!first);
+      if (s.doubling && !s.deck.empty()) eject(true);
+      first = false;
+      s.feed = over * CARD_DRAG;
+      s.cardDrawn = false;
+      s.dipUntil = nowS() + EDGE_DIP_S;
+    }
+  }
+  else if (d < 0)
+  {
+    s.feed += d;
+    if (s.feed < 0.0) s.feed = 0.0;
+    s.cardDrawn = false;  // the roller lets go on the way back
+    if (s.stuck)
+    {
+      s.backedOff -= d;
+      if (s.backedOff >= JAM_BACK_DEG)
+      {
+        std::uniform_real_distribution<double> u(0.0, 1.0);
+        s.stuck = false;
+        s.jamAgain = u(s.rng) >= JAM_CLEAR;
+        if (s.p.verbose)
+        {
+          printf("[%9.3f] roller backed off%s\n", nowS(), s.jamAgain ? ", still crooked" : "");
+        }
+      }
+    }
+  }
+}
+
+void stepImu(double dt)
+{
+  State &s = state();
+  (void)dt;
+  if (nowS() >= s.imuNextSample)
+  {
+    s.imuHeading = s.yaw + gauss(IMU_NOISE_DEG);
+    s.imuRate = s.yawRate + gauss(IMU_RATE_NOISE);
+    s.imuNextSample = nowS() + IMU_PERIOD;
+  }
+}
+
+void stepBattery(double dt)
+{
+  State &s = state();
+  double amps = 0.2;
+  for (int i = 0; i < 12; i++)
+  {
+    if (s.motors[i].used) amps += s.motors[i].load;
+  }
+  s.charge += amps * dt;
+}
+
+bool motorsIdle()
+{
+  State &s = state();
+  for (int i = 0; i < 12; i++)
+  {
+    const Motor &m = s.motors[i];
+    if (m.used && (m.spinning || fabs(m.vel) > 1.0)) return false;
+  }
+  return true;
+}
+
+void spawnCallback(void (*callback)(void));
+
+bool anySpinning()
+{
+  State &s = state();
+  return s.motors[PORT_LEFT].spinning || s.motors[PORT_RIGHT].spinning
+         || s.motors[PORT_DISPENSE].spinning;
+}
+
+// what the motors are doing, for emergency stop stats
+const char *motorPhase()
+{
+  State &s = state();
+  const Motor &d = s.motors[PORT_DISPENSE];
+  bool turning = s.motors[PORT_LEFT].spinning || s.motors[PORT_RIGHT].spinning;
+  bool feeding = d.spinning && !d.toTarget && d.dir > 0;
+  bool retracting = d.spinning && !feeding;
+  if (turning && feeding) return "turn+dispense";
+  if (turning && retracting) return "turn+retract";
+  if (turning) return "turn";
+  if (feeding) return "dispense";
+  if (retracting) return "retract";
+  return "idle";
+}
+
+void pressButton(int button)
+{
+  State &s = state();
+  double t = nowS();
+  s.down = button;
+  s.seen = false;
+  s.stats.presses++;
+  if (s.p.verbose) printf("[%9.3f] press %d\n", t, s.down);
+
+  if (button == 2 && s.p.suitLoads && s.deck.empty() && s.suitsLoaded < 4)
+  {
+    for (int i = 0; i < s.p.deckSize / 4; i++) s.deck.push_back(s.suitsLoaded);
+    s.suitsLoaded++;
+  }
+
+  if (button == 3 && anySpinning())
+  {
+    EmergencyStop e;
+    e.phase = motorPhase();
+    e.pressAt = t;
+    e.brakeMs = -1.0;
+    e.restMs = -1.0;
+    s.stats.estops.push_back(e);
+    s.estopPending = true;
+  }
+
+  if (s.onPressed[s.down])
+  {
+    s.seen = true;
+    s.seenAt = t;
+    spawnCallback(s.onPressed[s.down]);
+  }
+}
+
+// called after every motor stop() and physics step
+void checkEmergencyStop()
+{
+  State &s = state();
+  if (!s.estopPending) return;
+  EmergencyStop &e = s.stats.estops.back();
+  double t = nowS();
+  if (e.brakeMs < 0 && !anySpinning()) e.brakeMs = (t - e.pressAt) * 1000.0;
+  if (e.brakeMs >= 0 && motorsIdle())
+  {
+    e.restMs = (t - e.pressAt) * 1000.0;
+    s.estopPending = false;
+  }
+}
+
+void stepInput()
+{
+  State &s = state();
+  double t = nowS();
+  if (!motorsIdle() || t < s.busyUntil) s.lastActive = t;
+  checkEmergencyStop();
+
+  if (s.down >= 0)
+  {
+    if (s.seen && t - s.seenAt >= s.p.holdMs / 1000.0)
+    {
+      int b = s.down;
+      s.down = -1;
+      s.lastRelease = t;
+      if (s.p.verbose) printf("[%9.3f] release %d\n", t, b);
+      if (s.onReleased[b]) spawnCallback(s.onReleased[b]);
+    }
+    return;
+  }
+
+  if (s.timedPos < s.timed.size() && t >= s.timed[s.timedPos].at)
+  {
+    pressButton(s.timed[s.timedPos++].button);
+    return;
+  }
+
+  double think = s.p.thinkMs / 1000.0;
+  if (s.scriptPos < s.script.size())
+  {
+    if (t - s.lastRelease >= think && t - s.lastActive >= think)
+    {
+      pressButton(s.script[s.scriptPos++].button);
+    }
+  }
+  else if (s.timedPos < s.timed.size())
+  {
+    // still waiting on a timed press
+  }
+  else if (t - s.lastActive >= s.p.idleExitS && t - s.lastRelease >= s.p.idleExitS)
+  {
+    report("input script finished");
+  }
+}
+
+void advanceTo(uint64_t target)
+{
+  State &s = state();
+  while (s.now < target)
+  {
+    uint64_t step = target - s.now;
+    if (step > STEP_US) step = STEP_US;
+    s.now += step;
+    double dt = step / 1e6;
+    stepDrive(dt);
+    stepDispenser(dt);
+    stepImu(dt);
+    stepBattery(dt);
+    stepInput();
+    if (nowS() >= s.p.limitS) report("virtual time limit reached");
+  }
+}
+
+// ---------------------- cooperative scheduler
+Task *pickNext()
+{
+  State &s = state();
+  Task *best = 0;
+  for (size_t i = 0; i < s.tasks.size(); i++)
+  {
+    Task *t = s.tasks[i];
+    if (t->done) continue;
+    if (!best || t->wake < best->wake || (t->wake == best->wake && t->seq < best->seq))
+    {
+      best = t;
+    }
+  }
+  return best;
+}
+
+// hand the virtual cpu to whoever wakes first; returns once this task runs again
+void schedule(std::unique_lock<std::mutex> &lock)
+{
+  State &s = state();
+  Task *self = s.tasks[s.running];
+  while (true)
+  {
+    Task *next = pickNext();
+    if (!next) report("all threads finished");
+    advanceTo(next->wake);
+    // physics may have spawned a callback that wakes earlier than next
+    Task *again = pickNext();
+    if (again != next) continue;
+    if (next == self) return;
+    s.running = next->id;
+    next->cv.notify_one();
+    break;
+  }
+  self->cv.wait(lock, [&] { return s.running == self->id; });
+}
+
+void sleepUntil(uint64_t wake)
+{
+  State &s = state();
+  std::unique_lock<std::mutex> lock(s.big, std::adopt_lock);
+  Task *self = s.tasks[s.running];
+  self->wake = wake < s.now ? s.now : wake;
+  self->seq = ++s.seq;
+  if (self->interrupted)
+  {
+    // interrupted threads never run again
+    self->done = true;
+    Task *next = pickNext();
+    if (!next) report("all threads finished");
+    advanceTo(next->wake);
+    s.running = next->id;
+    next->cv.notify_one();
+    self->cv.wait(lock, [] { return false; });
+  }
+  schedule(lock);
+  lock.release();
+}
+
+void poll() { sleepUntil(state().now + POLL_US); }
+
+Task *newTask()
+{
+  State &s = state();
+  Task *t = new Task();
+  t->id = (int)s.tasks.size();
+  t->wake = s.now;
+  t->seq = ++s.seq;
+  s.tasks.push_back(t);
+  return t;
+}
+
+template <typename F>
+int startTask(F body)
+{
+  Task *t = newTask();
+  int id = t->id;
+  std::thread th([id, body]() {
+    State &s = state();
+    std::unique_lock<std::mutex> lock(s.big);
+    Task *self = s.tasks[id];
+    self->cv.wait(lock, [&] { return s.running == id; });
+    lock.release();
+    body();
+    lock = std::unique_lock<std::mutex>(s.big, std::adopt_lock);
+    self->done = true;
+    Task *next = pickNext();
+    if (!next) report("all threads finished");
+    advanceTo(next->wake);
+    s.running = next->id;
+    next->cv.notify_one();
+  });
+  th.detach();
+  return id;
+}
+
+// the callback doesn't run at the press: it waits a random part of
+// callbackMs for the event dispatch, so whatever polls the button can win
+void spawnCallback(void (*callback)(void))
+{
+  State &s = state();
+  std::uniform_real_distribution<double> u(0.0, s.p.callbackMs * 1000.0);
+  int id = startTask([callback]() { callback(); });
+  s.tasks[id]->wake += (uint64_t)u(s.eventRng);
+}
+
+// ---------------------- report
+double percentile(std::vector<double> v, double q)
+{
+  if (v.empty()) return 0.0;
+  std::sort(v.begin(), v.end());
+  size_t i = (size_t)ceil(q * v.size()) - 1;
+  if (i >= v.size()) i = v.size() - 1;
+  return v[i];
+}
+
+double mean(const std::vector<double> &v)
+{
+  if (v.empty()) return 0.0;
+  double sum = 0.0;
+  for (size_t i = 0; i < v.size(); i++) sum += v[i];
+  return sum / v.size();
+}
+
+void printSeries(const char *name, const std::vector<double> &v)
+{
+  printf("%-16s n=%-4d mean=%7.1f p95=%7.1f max=%7.1f ms\n", name, (int)v.size(),
+         mean(v), percentile(v, 0.95), v.empty() ? 0.0 : percentile(v, 1.0));
+}
+
+[[noreturn]] void report(const char *why)
+{
+  State &s = state();
+  double wall = std::chrono::duration<double>(std::chrono::steady_clock::now()
+                                              - s.wallStart).count();
+  const std::vector<Ejection> &cards = s.stats.cards;
+
+  printf("\n---------------------- sim report (%s)\n", why);
+  printf("virtual time     %.1f s (wall %.2f s, %.0fx real time)\n", nowS(), wall,
+         wall > 0 ? nowS() / wall : 0.0);
+  printf("cards out        %d (double feeds %d, left in tray %d)\n",
+         (int)cards.size(), s.stats.doubleFeeds, (int)s.deck.size());
+  if (s.stats.jams > 0)
+  {
+    printf("jams             %d (roller stalled %.0f ms)\n", s.stats.jams,
+           s.stats.jammedS * 1000.0);
+  }
+  if (cards.size() >= 2)
+  {
+    double span = cards.back().time - cards.front().time;
+    printf("throughput       %.1f cards/min (first to last card)\n",
+           (cards.size() - 1) / span * 60.0);
+    std::vector<double> rates;
+    for (size_t i = 0; i < cards.size(); i++) rates.push_back(fabs(cards[i].rate));
+    printf("rate at exit     mean=%.1f max=%.1f dps\n", mean(rates),
+           percentile(rates, 1.0));
+  }
+  if (s.p.seats > 0 && !cards.empty())
+  {
+    // landing error against the nearest seat heading
+    double seat = 360.0 / s.p.seats;
+    std::vector<double> errors;
+    for (size_t i = 0; i < cards.size(); i++)
+    {
+      double e = fmod(cards[i].landing, seat);
+      errors.push_back(e > seat / 2 ? seat - e : e);
+    }
+    printf("seat error       mean=%.2f p95=%.2f max=%.2f deg (%d seats)\n",
+           mean(errors), percentile(errors, 0.95), percentile(errors, 1.0), s.p.seats);
+
+    // cards that landed at each seat, to check every hand came out right
+    std::vector<int> count(s.p.seats, 0);
+    for (size_t i = 0; i < cards.size(); i++)
+    {
+      count[(int)floor(cards[i].landing / seat + 0.5) % s.p.seats]++;
+    }
+    printf("seat cards      ");
+    for (int i = 0; i < s.p.seats; i++) printf(" %d", count[i]);
+    printf("\n");
+
+    // for a sort: cards that aren't the main suit of the seat they landed on
+    std::vector<int> suits(s.p.seats * 4, 0);
+    for (size_t i = 0; i < cards.size(); i++)
+    {
+      suits[((int)floor(cards[i].landing / seat + 0.5) % s.p.seats) * 4 + cards[i].suit]++;
+    }
+    int offSuit = 0;
+    for (int i = 0; i < s.p.seats; i++)
+    {
+      int most = 0;
+      for (int k = 0; k < 4; k++) if (suits[i * 4 + k] > most) most = suits[i * 4 + k];
+      offSuit += count[i] - most;
+    }
+    printf("off-suit cards   %d\n", offSuit);
+  }
+  printSeries("turn latency", s.stats.turnMs);
+  printSeries("dispense cycle", s.stats.dispenseMs);
+  if (!s.stats.overshoot.empty())
+  {
+    printf("turn overshoot   mean=%.2f max=%.2f deg\n", mean(s.stats.overshoot),
+           percentile(s.stats.overshoot, 1.0));
+  }
+  printf("battery          %.2f V\n", batteryVoltage());
+  if (s.stats.sdWrites > 0)
+  {
+    printf("sd writes        %d (%.1f KB), longest stall %.1f ms\n", s.stats.sdWrites,
+           s.stats.sdBytes / 1024.0, s.stats.sdStallMs);
+  }
+  for (size_t i = 0; i < s.stats.estops.size(); i++)
+  {
+    const EmergencyStop &e = s.stats.estops[i];
+    printf("estop            %-14s at %.3f s: braked %.2f ms, at rest %.1f ms\n",
+           e.phase, e.pressAt, e.brakeMs, e.restMs);
+  }
+  printf("button presses   %d of %d scripted\n", s.stats.presses,
+         (int)(s.script.size() + s.timed.size()));
+  fflush(stdout);
+  _Exit(0);
+}
+
+// ---------------------- setup
+void parseScript(const char *text)
+{
+  State &s = state();
+  const char *c = text;
+  while (*c)
+  {
+    int b = -1;
+    switch (*c)
+    {
+      case 'L': b = 0; break;
+      case 'R': b = 1; break;
+      case 'C': b = 2; break;
+      case 'T': b = 3; break;
+      default: break;
+    }
+    c++;
+    if (b < 0) continue;
+    Press p;
+    p.button = b;
+    p.at = -1.0;
+    if (*c == '@')
+    {
+      p.at = strtod(c + 1, (char **)&c);
+      s.timed.push_back(p);
+      continue;
+    }
+    int count = 1;
+    if (*c >= '0' && *c <= '9') count = (int)strtol(c, (char **)&c, 10);
+    for (int i = 0; i < count; i++)
+    {
+      s.script.push_back(p);
+    }
+  }
+  std::sort(s.timed.begin(), s.timed.end(),
+            [](const Press &a, const Press &b) { return a.at < b.at; });
+}
+
+void usage()
+{
+  printf("usage: sim [options]\n"
+         "  -s SCRIPT   button presses: L R C (check) T (touchled), e.g. \"C R2 C R12 C\"\n"
+         "              X@SEC presses X at that virtual time, e.g. T@20.5\n"
+         "  -n SEED     random seed (default 1)\n"
+         "  -d CARDS    cards in the tray (default 52)\n"
+         "  -b VOLTS    starting battery voltage (default 8.2)\n"
+         "  -t MS       think time before each press (default 400)\n"
+         "  -e MS       button callbacks run up to MS after the press (default 20)\n"
+         "  -l SEC      virtual time limit (default 3600)\n"
+         "  -a SEATS    report landing error against SEATS evenly spaced seats\n"
+         "  -f SCALE    table friction, 0.5 smooth table .. 2 carpet (default 1)\n"
+         "  -m SLIP,DBL chance per card of a roller slip and of a double feed\n"
+         "  -j JAM      chance per card of a jam part way out\n"
+         "  -o SD,JUNK  optical hue noise in deg (default 4) and chance a hue\n"
+         "              read is junk\n"
+         "  -g HUE,SCALE room light: hue shift in deg and brightness scale\n"
+         "  -k          tray starts empty; each check press on an empty tray\n"
+         "              loads the next suit (hearts, spades, diamonds, clubs)\n"
+         "  -u CHANCE   deck not well shuffled: chance each card is the suit after\n"
+         "              the last one, in the order hearts diamonds spades clubs\n"
+         "  -S          no sd card in the brain\n"
+         "  -v          log presses and cards\n"
+         "  -p          log screen output\n");
+}
+
+void setup(int argc, char **argv)
+{
+  State &s = state();
+  for (int i = 1; i < argc; i++)
+  {
+    const char *a = argv[i];
+    const char *val = i + 1 < argc ? argv[i + 1] : "";
+    if (!strcmp(a, "-s")) { s.p.script = val; i++; }
+    else if (!strcmp(a, "-n")) { s.p.seed = (unsigned)atoi(val); i++; }
+    else if (!strcmp(a, "-d")) { s.p.deckSize = atoi(val); i++; }
+    else if (!strcmp(a, "-b")) { s.p.battery = atof(val); i++; }
+    else if (!strcmp(a, "-t")) { s.p.thinkMs = atof(val); i++; }
+    else if (!strcmp(a, "-e")) { s.p.callbackMs = atof(val); i++; }
+    else if (!strcmp(a, "-l")) { s.p.limitS = atof(val); i++; }
+    else if (!strcmp(a, "-a")) { s.p.seats = atoi(val); i++; }
+    else if (!strcmp(a, "-f")) { s.p.friction = atof(val); i++; }
+    else if (!strcmp(a, "-m"))
+    {
+      sscanf(val, "%lf,%lf", &s.p.slipRate, &s.p.doubleRate);
+      i++;
+    }
+    else if (!strcmp(a, "-j")) { s.p.jamRate = atof(val); i++; }
+    else if (!strcmp(a, "-g"))
+    {
+      sscanf(val, "%lf,%lf", &s.p.hueShift, &s.p.lightScale);
+      i++;
+    }
+    else if (!strcmp(a, "-k")) s.p.suitLoads = true;
+    else if (!strcmp(a, "-u")) { s.p.suitCycle = atof(val); i++; }
+    else if (!strcmp(a, "-o"))
+    {
+      sscanf(val, "%lf,%lf", &s.p.hueNoise, &s.p.hueGlitch);
+      i++;
+    }
+    else if (!strcmp(a, "-S")) s.p.sdCard = false;
+    else if (!strcmp(a, "-v")) s.p.verbose = true;
+    else if (!strcmp(a, "-p")) s.p.screen = true;
+    else { usage(); exit(1); }
+  }
+
+  s.rng.seed(s.p.seed);
+  s.eventRng.seed(s.p.seed);
+  parseScript(s.p.script.c_str());
+  if (!s.p.suitLoads)
+  {
+    for (int i = 0; i < s.p.deckSize; i++) s.deck.push_back(i % 4);
+    std::shuffle(s.deck.begin(), s.deck.end(), s.rng);
+  }
+  if (s.p.suitCycle > 0.0)
+  {
+    // pull the suit after the last card's forward from further down
+    static const int NEXT_SUIT[4] = {2, 3, 1, 0};
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    for (size_t i = 1; i < s.deck.size(); i++)
+    {
+      if (u(s.rng) >= s.p.suitCycle) continue;
+      for (size_t j = i; j < s.deck.size(); j++)
+      {
+        if (s.deck[j] != NEXT_SUIT[s.deck[i - 1]]) continue;
+        std::swap(s.deck[i], s.deck[j]);
+        break;
+      }
+    }
+  }
+  s.wallStart = std::chrono::steady_clock::now();
+}
+
+} // namespace sim
+
+// ---------------------- vex api
+namespace vex {
+
+using sim::state;
+
+const color color::red(colorType::red);
+const color color::green(colorType::green);
+const color color::blue(colorType::blue);
+const color color::yellow(colorType::yellow);
+const color color::orange(colorType::orange);
+const color color::purple(colorType::purple);
+const color color::cyan(colorType::cyan);
+const color color::white(colorType::white);
+const color color::black(colorType::black);
+
+// a long wait on the main thread means it's showing something, not waiting
+// for input, so scripted presses hold off until it's over
+static void sleepFor(uint64_t us)
+{
+  sim::State &s = state();
+  if (s.running == 0 && us >= sim::LONG_WAIT_US)
+  {
+    double end = (s.now + us) / 1e6;
+    if (end > s.busyUntil) s.busyUntil = end;
+  }
+  sim::sleepUntil(s.now + us);
+}
+
+void wait(double time, timeUnits units)
+{
+  double us = units == timeUnits::sec ? time * 1e6 : time * 1e3;
+  sleepFor((uint64_t)(us > 0 ? us : 0));
+}
+
+timer::timer() : start(state().now) {}
+
+double timer::time(timeUnits units) const
+{
+  sim::poll();
+  double ms = (state().now - start) / 1000.0;
+  return units == timeUnits::sec ? ms / 1000.0 : ms;
+}
+
+void timer::clear() { start = state().now; }
+
+uint32_t timer::system()
+{
+  sim::poll();
+  return (uint32_t)(state().now / 1000);
+}
+
+uint64_t timer::systemHighResolution()
+{
+  sim::poll();
+  return state().now;
+}
+
+void this_thread::sleep_for(uint32_t ms) { sleepFor(ms * 1000ull); }
+void this_thread::sleep_until(uint32_t ms) { sim::sleepUntil(ms * 1000ull); }
+void this_thread::yield() { sim::poll(); }
+
+thread::thread(int (*callback)(void)) : id(sim::startTask([callback]() { callback(); })) {}
+thread::thread(void (*callback)(void)) : id(sim::startTask([callback]() { callback(); })) {}
+thread::thread(int (*callback)(void *), void *arg)
+  : id(sim::startTask([callback, arg]() { callback(arg); })) {}
+
+void thread::join()
+{
+  while (id >= 0 && !state().tasks[id]->done) sim::poll();
+}
+
+void thread::interrupt()
+{
+  if (id >= 0) state().tasks[id]->interrupted = true;
+}
+
+void mutex::lock()
+{
+  while (owned) sim::poll();
+  owned = true;
+}
+
+bool mutex::try_lock()
+{
+  if (owned) return false;
+  owned = true;
+  return true;
+}
+
+// ---------------------- brain
+void brain::lcd::print(const char *format, ...)
+{
+  char text[128];
+  va_list args;
+  va_start(args, format);
+  vsnprintf(text, sizeof(text), format, args);
+  va_end(args);
+  if (state().p.screen) printf("[%9.3f] screen %d: %s\n", sim::nowS(), cursorRow, text);
+}
+
+void brain::lcd::setCursor(int r, int c)
+{
+  cursorRow = r;
+  cursorCol = c;
+}
+
+void brain::lcd::clearScreen()
+{
+  cursorRow = 1;
+  cursorCol = 1;
+}
+
+void brain::lcd::clearLine(int r) { cursorRow = r; }
+
+void brain::lcd::newLine()
+{
+  cursorRow++;
+  cursorCol = 1;
+}
+
+bool brain::button::pressing() const
+{
+  sim::poll();
+  sim::State &s = state();
+  if (s.down != index) return false;
+  if (!s.seen)
+  {
+    s.seen = true;
+    s.seenAt = sim::nowS();
+  }
+  return true;
+}
+
+void brain::button::pressed(void (*callback)(void)) { state().onPressed[index] = callback; }
+void brain::button::released(void (*callback)(void)) { state().onReleased[index] = callback; }
+
+double brain::battery::voltage(voltageUnits units) const
+{
+  sim::poll();
+  double v = sim::batteryVoltage();
+  return units == voltageUnits::mV ? v * 1000.0 : v;
+}
+
+double brain::battery::current(currentUnits units) const
+{
+  (void)units;
+  sim::poll();
+  double amps = 0.2;
+  for (int i = 0; i < 12; i++)
+  {
+    if (state().motors[i].used) amps += state().motors[i].load;
+  }
+  return amps;
+}
+
+uint32_t brain::battery::capacity(percentUnits units) const
+{
+  (void)units;
+  double v = sim::batteryVoltage();
+  return (uint32_t)((v - sim::BATTERY_EMPTY) / (sim::BATTERY_FULL - sim::BATTERY_EMPTY) * 100.0);
+}
+
+// the sd card is a folder on the host
+static std::string sdPath(const char *name) { return std::string("sim_sd_") + name; }
+
+// writes block the whole brain while they run: physics goes on, no thread does
+static void sdWriteStall(int32_t len)
+{
+  sim::State &s = state();
+  uint64_t us = sim::SD_WRITE_US + sim::SD_BYTE_US * (uint64_t)len;
+  s.stats.sdWrites++;
+  s.stats.sdBytes += len;
+  if (us / 1000.0 > s.stats.sdStallMs) s.stats.sdStallMs = us / 1000.0;
+  sim::advanceTo(s.now + us);
+}
+
+bool brain::sdcard::isInserted() const { return state().p.sdCard; }
+
+int32_t brain::sdcard::savefile(const char *name, uint8_t *buffer, int32_t len)
+{
+  if (!state().p.sdCard) return 0;
+  sdWriteStall(len);
+  FILE *f = fopen(sdPath(name).c_str(), "wb");
+  if (!f) return 0;
+  int32_t n = (int32_t)fwrite(buffer, 1, (size_t)len, f);
+  fclose(f);
+  return n;
+}
+
+int32_t brain::sdcard::appendfile(const char *name, uint8_t *buffer, int32_t len)
+{
+  if (!state().p.sdCard) return 0;
+  sdWriteStall(len);
+  FILE *f = fopen(sdPath(name).c_str(), "ab");
+  if (!f) return 0;
+  int32_t n = (int32_t)fwrite(buffer, 1, (size_t)len, f);
+  fclose(f);
+  return n;
+}
+
+int32_t brain::sdcard::loadfile(const char *name, uint8_t *buffer, int32_t len)
+{
+  if (!state().p.sdCard) return 0;
+  FILE *f = fopen(sdPath(name).c_str(), "rb");
+  if (!f) return 0;
+  int32_t n = (int32_t)fread(buffer, 1, (size_t)len, f);
+  fclose(f);
+  return n;
+}
+
+bool brain::sdcard::exists(const char *name)
+{
+  if (!state().p.sdCard) return false;
+  FILE *f = fopen(sdPath(name).c_str(), "rb");
+  if (!f) return false;
+  fclose(f);
+  return true;
+}
+
+int32_t brain::sdcard::size(const char *name)
+{
+  if (!state().p.sdCard) return 0;
+  FILE *f = fopen(sdPath(name).c_str(), "rb");
+  if (!f) return 0;
+  fseek(f, 0, SEEK_END);
+  int32_t n = (int32_t)ftell(f);
+  fclose(f);
+  return n;
+}
+
+void brain::programStop() { sim::report("programStop"); }
+
+// ---------------------- motor
+static double toDeg(double value, rotationUnits units)
+{
+  return units == rotationUnits::rev ? value * 360.0 : value;
+}
+
+static double fromDeg(double value, rotationUnits units)
+{
+  return units == rotationUnits::rev ? value / 360.0 : value;
+}
+
+// a dispense cycle runs from the forward start to the stop after the retract,
+// with a brake stop in between
+static bool inDispenseCycle(int32_t port)
+{
+  return port == sim::PORT_DISPENSE && state().motors[port].spinStart >= 0;
+}
+
+motor::motor(int32_t p, bool reverse) : port(p)
+{
+  state().motors[port].used = true;
+  state().motors[port].reversed = reverse;
+}
+
+void motor::spin(directionType dir)
+{
+  sim::Motor &m = state().motors[port];
+  if (!m.spinning && !inDispenseCycle(port))
+  {
+    m.spinStart = sim::nowS();
+    m.reversedInCycle = false;
+    if (port == sim::PORT_LEFT)
+    {
+      state().turnStartYaw = state().yaw;
+      state().turnPeak = 0.0;
+    }
+  }
+  m.spinning = true;
+  m.toTarget = false;
+  m.dir = dir == directionType::rev ? -1 : 1;
+  if (m.dir < 0) m.reversedInCycle = true;
+}
+
+void motor::spin(directionType dir, double velocity, percentUnits units)
+{
+  setVelocity(velocity, units);
+  spin(dir);
+}
+
+void motor::spin(directionType dir, double velocity, velocityUnits units)
+{
+  setVelocity(velocity, units);
+  spin(dir);
+}
+
+bool motor::spinToPosition(double rotation, rotationUnits units, bool waitForCompletion)
+{
+  sim::Motor &m = state().motors[port];
+  if (!m.spinning && !inDispenseCycle(port))
+  {
+    m.spinStart = sim::nowS();
+    m.reversedInCycle = false;
+  }
+  m.target = toDeg(rotation, units) + m.posOffset;
+  if (m.target < m.pos) m.reversedInCycle = true;
+  m.spinning = true;
+  m.toTarget = true;
+  if (!waitForCompletion) return true;
+  while (!isDone()) sim::poll();
+  return true;
+}
+
+bool motor::spinFor(directionType dir, double rotation, rotationUnits units,
+                    bool waitForCompletion)
+{
+  sim::Motor &m = state().motors[port];
+  double d = toDeg(rotation, units) * (dir == directionType::rev ? -1 : 1);
+  return spinToPosition(fromDeg(m.pos - m.posOffset + d, units), units, waitForCompletion);
+}
+
+void motor::stop() { stop(state().motors[port].stopping); }
+
+void motor::stop(brakeType mode)
+{
+  sim::State &s = state();
+  sim::Motor &m = s.motors[port];
+  if (m.spinning && m.spinStart >= 0)
+  {
+    double ms = (sim::nowS() - m.spinStart) * 1000.0;
+    if (port == sim::PORT_LEFT)
+    {
+      s.stats.turnMs.push_back(ms);
+      double travel = s.yaw - s.turnStartYaw;
+      double over = fabs(s.turnPeak) - fabs(travel);
+      s.stats.overshoot.push_back(over > 0 ? over : 0.0);
+    }
+    if (port == sim::PORT_DISPENSE && m.reversedInCycle) s.stats.dispenseMs.push_back(ms);
+    if (port != sim::PORT_DISPENSE || m.reversedInCycle) m.spinStart = -1.0;
+  }
+  m.spinning = false;
+  m.toTarget = false;
+  m.stopMode = mode;
+  sim::checkEmergencyStop();
+}
+
+void motor::setVelocity(double velocity, percentUnits units)
+{
+  (void)units;
+  if (velocity > 100.0) velocity = 100.0;
+  if (velocity < -100.0) velocity = -100.0;
+  state().motors[port].cmdPct = velocity;
+}
+
+void motor::setVelocity(double velocity, velocityUnits units)
+{
+  if (units == velocityUnits::rpm) velocity = velocity * 6.0 / sim::MOTOR_MAX_DPS * 100.0;
+  else if (units == velocityUnits::dps) velocity = velocity / sim::MOTOR_MAX_DPS * 100.0;
+  setVelocity(velocity, percentUnits::pct);
+}
+
+void motor::setStopping(brakeType mode) { state().motors[port].stopping = mode; }
+
+void motor::setPosition(double value, rotationUnits units)
+{
+  sim::Motor &m = state().motors[port];
+  m.posOffset = m.pos - toDeg(value, units);
+}
+
+void motor::setMaxTorque(double value, percentUnits units)
+{
+  (void)units;
+  state().motors[port].maxTorquePct = value;
+}
+
+void motor::setTimeout(int32_t time, timeUnits units)
+{
+  (void)time;
+  (void)units;
+}
+
+double motor::position(rotationUnits units) const
+{
+  sim::poll();
+  const sim::Motor &m = state().motors[port];
+  return fromDeg(m.pos - m.posOffset, units);
+}
+
+double motor::velocity(percentUnits units) const
+{
+  (void)units;
+  sim::poll();
+  return state().motors[port].vel / sim::MOTOR_MAX_DPS * 100.0;
+}
+
+double motor::velocity(velocityUnits units) const
+{
+  sim::poll();
+  double v = state().motors[port].vel;
+  if (units == velocityUnits::rpm) return v / 6.0;
+  if (units == velocityUnits::pct) return v / sim::MOTOR_MAX_DPS * 100.0;
+  return v;
+}
+
+double motor::current(currentUnits units) const
+{
+  (void)units;
+  sim::poll();
+  return state().motors[port].load;
+}
+
+double motor::current(percentUnits units) const
+{
+  (void)units;
+  sim::poll();
+  return state().motors[port].load / 1.2 * 100.0;
+}
+
+double motor::torque(torqueUnits units) const
+{
+  sim::poll();
+  double nm = state().motors[port].load * 0.35;
+  return units == torqueUnits::InLb ? nm * 8.851 : nm;
+}
+
+bool motor::isDone() const
+{
+  sim::poll();
+  const sim::Motor &m = state().motors[port];
+  if (!m.toTarget) return true;
+  return fabs(m.target - m.pos) < 1.0 && fabs(m.vel) < 5.0;
+}
+
+bool motor::isSpinning() const
+{
+  sim::poll();
+  const sim::Motor &m = state().motors[port];
+  return m.spinning && !isDone();
+}
+
+// ---------------------- inertial
+void inertial::calibrate() { state().calibrateUntil = sim::nowS() + 2.0; }
+
+bool inertial::isCalibrating() const
+{
+  sim::poll();
+  return sim::nowS() < state().calibrateUntil;
+}
+
+void inertial::setHeading(double value, rotationUnits units)
+{
+  sim::State &s = state();
+  s.imuOffset = s.imuHeading - toDeg(value, units);
+}
+
+void inertial::setRotation(double value, rotationUnits units)
+{
+  sim::State &s = state();
+  s.rotOffset = s.imuHeading - toDeg(value, units);
+}
+
+double inertial::heading(rotationUnits units) const
+{
+  sim::poll();
+  sim::State &s = state();
+  double h = fmod(s.imuHeading - s.imuOffset, 360.0);
+  if (h < 0) h += 360.0;
+  return fromDeg(h, units);
+}
+
+double inertial::rotation(rotationUnits units) const
+{
+  sim::poll();
+  sim::State &s = state();
+  return fromDeg(s.imuHeading - s.rotOffset, units);
+}
+
+double inertial::acceleration(axisType axis) const
+{
+  sim::poll();
+  double g = axis == axisType::zaxis ? -1.0 : 0.0;
+  return g + sim::gauss(0.003);
+}
+
+double inertial::gyroRate(axisType axis, velocityUnits units) const
+{
+  sim::poll();
+  if (axis != axisType::zaxis) return sim::gauss(sim::IMU_RATE_NOISE);
+  double r = state().imuRate;
+  return units == velocityUnits::rpm ? r / 6.0 : r;
+}
+
+// ---------------------- optical
+static double cardHue()
+{
+  sim::State &s = state();
+  if (s.deck.empty()) return sim::TRAY_HUE + s.p.hueShift + sim::gauss(2.0);
+  if (s.p.hueGlitch > 0.0)
+  {
+    std::uniform_real_distribution<double> u(0.0, 1.0);
+    if (u(s.rng) < s.p.hueGlitch) return u(s.rng) * 360.0;
+  }
+  double h = sim::SUIT_HUE[s.deck.front()] + s.p.hueShift + sim::gauss(s.p.hueNoise);
+  return fmod(h + 360.0, 360.0);
+}
+
+double optical::hue() const
+{
+  sim::poll();
+  return cardHue();
+}
+
+double optical::brightness() const
+{
+  sim::poll();
+  sim::State &s = state();
+  if (s.deck.empty()) return 25.0 * s.p.lightScale + sim::gauss(1.0);
+  if (sim::nowS() < s.dipUntil) return 30.0 * s.p.lightScale + sim::gauss(3.0);
+  return 55.0 * s.p.lightScale + sim::gauss(3.0);
+}
+
+optical::rgbc optical::getRgb() const
+{
+  // hsv -> rgb with full saturation, scaled by brightness
+  double h = hue();
+  double v = brightness() / 100.0 * 255.0;
+  double x = v * (1.0 - fabs(fmod(h / 60.0, 2.0) - 1.0));
+  rgbc c;
+  c.brightness = v / 255.0 * 100.0;
+  if (h < 60) { c.red = v; c.green = x; c.blue = 0; }
+  else if (h < 120) { c.red = x; c.green = v; c.blue = 0; }
+  else if (h < 180) { c.red = 0; c.green = v; c.blue = x; }
+  else if (h < 240) { c.red = 0; c.green = x; c.blue = v; }
+  else if (h < 300) { c.red = x; c.green = 0; c.blue = v; }
+  else { c.red = v; c.green = 0; c.blue = x; }
+  return c;
+}
+
+bool optical::isNearObject() const
+{
+  sim::poll();
+  return !state().deck.empty();
+}
+
+void optical::setLight(ledState s) { (void)s; }
+
+void optical::setLightPower(double value, percentUnits units)
+{
+  (void)value;
+  (void)units;
+}
+
+// ---------------------- touchled
+bool touchled::pressing() const
+{
+  sim::poll();
+  sim::State &s = state();
+  if (s.down != 3) return false;
+  if (!s.seen)
+  {
+    s.seen = true;
+    s.seenAt = sim::nowS();
+  }
+  return true;
+}
+
+void touchled::pressed(void (*callback)(void)) { state().onPressed[3] = callback; }
+void touchled::released(void (*callback)(void)) { state().onReleased[3] = callback; }
+void touchled::setColor(color c) { state().led = c; }
+void touchled::setBrightness(double value) { (void)value; }
+
+} // namespace vex
+
+// ---------------------- entry point
+int main(int argc, char **argv)
+{
+  sim::setup(argc, argv);
+  sim::State &s = sim::state();
+  s.big.lock();
+  sim::Task *t = sim::newTask();
+  s.running = t->id;
+  vexMain();
+  sim::report("main returned");
+  return 0;
+}
@@ -35,150 +35,1842 @@ void configureAllSensors()
   MotorRight.setPosition(0, turns);
   MotorDispense.setPosition(0, deg);
   OpticalSensor.setLight(ledState::on);
+  TouchLED.setColor(color::green);
 }
 
+// ---------------------- emergency stop
+// pressing the touchled while an operation is running brakes all three
+// motors straight from the touchled callback. estopTask backs it up: it runs
+// at high priority, checks the touchled every ESTOP_POLL_MS and keeps the
+// motors braked while the stop is active, so even if a callback is late the
+// robot stops within ESTOP_POLL_MS. the rest of the program sees
+// emergencyStop, returns out of whatever it was doing and main() shows the
+// stop screen. (every loop that runs motors waits or yields at least every
+// 10 ms, so nothing can hold off estopTask longer than that)
+const int ESTOP_POLL_MS = 5;
+
+volatile bool emergencyStop = false;     // set once pressed, cleared by main()
+volatile bool operationRunning = false;  // deal / shuffle / sort in progress
+volatile bool waitingForInput = false;   // touchled is a menu button right now
+
+// touchled counts as the emergency stop during an operation, but not while
+// a menu inside it (like askContinue) is waiting for a button
+bool emergencyStopArmed()
+{
+  return operationRunning && !waitingForInput;
+}
+
+void brakeAllMotors()
+{
+  MotorLeft.stop(brake);
+  MotorRight.stop(brake);
+  MotorDispense.stop(brake);
+}
+
+void triggerEmergencyStop()
+{
+  emergencyStop = true;
+  brakeAllMotors();
+  TouchLED.setColor(color::red);
+}
+
+int estopTask()
+{
+  while (true)
+  {
+    if (!emergencyStop && emergencyStopArmed() && TouchLED.pressing())
+    {
+      triggerEmergencyStop();
+    }
+    if (emergencyStop)
+    {
+      brakeAllMotors(); // hold them in case anything tried to restart
+    }
+    wait(ESTOP_POLL_MS, msec);
+  }
+  return 0;
+}
+
+// ---------------------- fixed rate loop
+// control loops wake on absolute deadlines instead of wait(loopTime) after
+// their work, so the period doesn't grow with compute and screen time. each
+// tick measures the real dt for the controller. a tick that starts after its
+// deadline is an overrun: we don't try to catch up, the next deadline is one
+// period from now. jitter is how far each period was from the one asked for.
+struct LoopStats
+{
+  uint32_t ticks;
+  uint32_t overruns;
+  float jitterSum;   // ms
+  float jitterMax;   // ms
+};
+
+struct LoopClock
+{
+  uint32_t periodMs;
+  uint32_t deadline;  // timer::system() ms of the next tick
+  uint64_t lastTick;  // us, timer::systemHighResolution()
+  float dt;           // seconds between the last two ticks, 0 before the first
+  LoopStats *stats;
+};
+
+LoopStats turnLoopStats;  // rotateToHeadingPID, reset with the phase times
+
+void resetLoopStats(LoopStats &s)
+{
+  s.ticks = 0;
+  s.overruns = 0;
+  s.jitterSum = 0.0f;
+  s.jitterMax = 0.0f;
+}
+
+void startLoop(LoopClock &c, uint32_t periodMs, LoopStats *stats)
+{
+  c.periodMs = periodMs;
+  c.deadline = timer::system();
+  c.lastTick = timer::systemHighResolution();
+  c.dt = 0.0f;
+  c.stats = stats;
+}
+
+// sleeps until the next deadline, then updates dt
+void waitForTick(LoopClock &c)
+{
+  c.deadline += c.periodMs;
+  uint32_t now = timer::system();
+  bool overrun = (int32_t)(c.deadline - now) < 0;
+  if (overrun)
+  {
+    c.deadline = now;
+  }
+  else
+  {
+    this_thread::sleep_until(c.deadline);
+  }
+
+  uint64_t tick = timer::systemHighResolution();
+  c.dt = (float)(tick - c.lastTick) / 1000000.0f;
+  c.lastTick = tick;
+
+  if (c.stats)
+  {
+    float jitter = fabsf(c.dt * 1000.0f - (float)c.periodMs);
+    c.stats->ticks++;
+    if (overrun) c.stats->overruns++;
+    c.stats->jitterSum += jitter;
+    if (jitter > c.stats->jitterMax) c.stats->jitterMax = jitter;
+  }
+}
+
+// ---------------------- phase timing
+// how long each part of a deal takes, so we can see what limits cards/min.
+// every measurement goes into a fixed histogram per phase (no allocation),
+// min/mean/max are exact and p95 is read off the histogram. a session starts
+// when a mode is picked, showPhaseTimes() puts it on the screen after each
+// cycle. turn and dispense can overlap when dispensing on approach.
+const int PHASE_TURN     = 0;  // rotateToHeadingPID following the profile
+const int PHASE_SETTLE   = 1;  // rotateToHeadingPID after the profile ends
+const int PHASE_DISPENSE = 2;  // forward stroke of the dispenser
+const int PHASE_RETRACT  = 3;  // time spent waiting for the retract
+const int PHASE_PAUSE    = 4;  // wait between cards
+const int PHASE_MENU     = 5;  // menus during the session
+const int NUM_PHASES     = 6;
+
+const char *const phaseNames[NUM_PHASES] =
+  {"turn", "settl", "disp", "rwait", "pause", "menu"};
+
+// upper edge of each bucket in ms, the last bucket is everything above
+const int NUM_BUCKETS = 13;
+const uint32_t bucketEdge[NUM_BUCKETS - 1] =
+  {10, 20, 40, 60, 80, 100, 150, 200, 300, 500, 1000, 2000};
+
+uint32_t phaseCount[NUM_PHASES];
+uint32_t phaseSum[NUM_PHASES];
+uint32_t phaseMin[NUM_PHASES];
+uint32_t phaseMax[NUM_PHASES];
+uint16_t phaseHist[NUM_PHASES][NUM_BUCKETS];
+
+void resetPhaseTimes()
+{
+  for (int i = 0; i < NUM_PHASES; i++)
+  {
+    phaseCount[i] = 0;
+    phaseSum[i] = 0;
+    phaseMin[i] = 0xFFFFFFFF;
+    phaseMax[i] = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) phaseHist[i][b] = 0;
+  }
+  resetLoopStats(turnLoopStats);
+}
+
+void recordPhase(int phase, uint32_t ms)
+{
+  int b = 0;
+  while (b < NUM_BUCKETS - 1 && ms > bucketEdge[b]) b++;
+
+  phaseCount[phase]++;
+  phaseSum[phase] += ms;
+  if (ms < phaseMin[phase]) phaseMin[phase] = ms;
+  if (ms > phaseMax[phase]) phaseMax[phase] = ms;
+  if (phaseHist[phase][b] < 0xFFFF) phaseHist[phase][b]++;
+}
+
+// upper edge of the bucket holding the pct-th percentile (never above max)
+uint32_t phasePercentile(int phase, int pct)
+{
+  uint32_t needed = (phaseCount[phase] * pct + 99) / 100;
+  uint32_t seen = 0;
+  for (int b = 0; b < NUM_BUCKETS - 1; b++)
+  {
+    seen += phaseHist[phase][b];
+    if (seen >= needed)
+    {
+      return bucketEdge[b] < phaseMax[phase] ? bucketEdge[b] : phaseMax[phase];
+    }
+  }
+  return phaseMax[phase];
+}
+
+// wait between cards, counted as a pause
+void cardPause(int ms)
+{
+  uint32_t start = timer::system();
+  wait(ms, msec);
+  recordPhase(PHASE_PAUSE, timer::system() - start);
+}
+
+extern float breakawayPower[2];  // see deadband learning
+extern uint32_t breakawayOnsets;
+
+// two pages: min/avg/p95/max per phase, then a histogram per phase with one
+// character per bucket ('.' empty, 1-9 scaled to the fullest bucket)
+void showPhaseTimes()
+{
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("ms min/avg/p95/max");
+  for (int i = 0; i < NUM_PHASES; i++)
+  {
+    if (phaseCount[i] == 0) continue;
+    Brain.Screen.newLine();
+    Brain.Screen.print("%s %lu/%lu/%lu/%lu", phaseNames[i],
+                       (unsigned long)phaseMin[i],
+                       (unsigned long)(phaseSum[i] / phaseCount[i]),
+                       (unsigned long)phasePercentile(i, 95),
+                       (unsigned long)phaseMax[i]);
+  }
+  if (breakawayOnsets > 0)
+  {
+    Brain.Screen.newLine();
+    Brain.Screen.print("band cw %.1f ccw %.1f%%", (double)breakawayPower[0],
+                       (double)breakawayPower[1]);
+  }
+  if (turnLoopStats.ticks > 0)
+  {
+    Brain.Screen.newLine();
+    Brain.Screen.print("loop %lu late, jit %.1f/%.1f",
+                       (unsigned long)turnLoopStats.overruns,
+                       (double)(turnLoopStats.jitterSum / turnLoopStats.ticks),
+                       (double)turnLoopStats.jitterMax);
+  }
+  wait(2, seconds);
+
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("hist 10ms..2s+");
+  for (int i = 0; i < NUM_PHASES; i++)
+  {
+    if (phaseCount[i] == 0) continue;
+    uint16_t most = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++)
+    {
+      if (phaseHist[i][b] > most) most = phaseHist[i][b];
+    }
+
+    char bars[NUM_BUCKETS + 1];
+    for (int b = 0; b < NUM_BUCKETS; b++)
+    {
+      int n = phaseHist[i][b];
+      bars[b] = n == 0 ? '.' : (char)('1' + (n * 8) / most);
+    }
+    bars[NUM_BUCKETS] = 0;
+
+    Brain.Screen.newLine();
+    Brain.Screen.print("%-5s %s", phaseNames[i], bars);
+  }
+  wait(2, seconds);
+}
+
+// ---------------------- flight recorder
+// every rotateToHeadingPID loop, dispenser stroke and card out goes into a
+// ring buffer in ram. logTask writes it to the sd card in big blocks, but
+// only while no turn or stroke is running: an sd write holds up the brain
+// for several ms and would stretch the turn loop. a sweep deal is one turn
+// for the whole deal, far longer than the ring lasts, so it opens
+// logWindow between strokes when nothing is due for LOG_WRITE_MS. if the
+// ring fills during a turn new records are dropped (and counted), the
+// control loop never waits for the card. sim/flightlog turns the file
+// into csv.
+const char *const LOG_FILE = "flight.bin";
+const uint32_t LOG_MAGIC   = 0x474F4C46;  // "FLOG"
+const uint16_t LOG_VERSION = 2;  // 2: REC_CARD, REC_JAM, cards seen in REC_STROKE
+const int LOG_RING  = 512;     // records in ram (12 KB)
+const int LOG_BLOCK = 128;     // records per sd write (3 KB)
+const int LOG_IDLE_MS = 500;   // write a part block after this long idle
+const int LOG_WRITE_MS = 15;   // longest a block write holds up the brain
+
+const uint8_t REC_TURN     = 1;  // rotation, track error, integral, derivative
+const uint8_t REC_TURN_END = 2;  // target, final error, ms, profile ms
+const uint8_t REC_STROKE   = 3;  // start deg, end deg, ms, peak amps, cards seen
+const uint8_t REC_DROPPED  = 4;  // records lost because the ring was full
+const uint8_t REC_CARD     = 5;  // volts, battery scale, heading, ms since last card
+const uint8_t REC_JAM      = 6;  // stroke deg, ms lost, amps, torque, re-feeds
+
+const uint8_t LOG_TIMED_OUT = 1; // REC_TURN_END flags
+const uint8_t LOG_ESTOP     = 2;
+const uint8_t LOG_SLIP      = 4; // REC_STROKE flags, fewer/more cards than
+const uint8_t LOG_DOUBLE    = 8; // asked for
+const uint8_t LOG_JAM_STUCK = 16; // REC_JAM flag, gave up on it
+
+// layout is shared with sim/flightlog.cpp
+struct LogHeader
+{
+  uint32_t magic;
+  uint16_t version;
+  uint16_t recordSize;
+};
+
+struct LogRecord
+{
+  uint32_t time;    // ms, timer::system()
+  uint8_t  type;
+  int8_t   left;    // commanded power % (REC_TURN), cards seen (REC_STROKE),
+                    // re-feeds (REC_JAM)
+  int8_t   right;
+  uint8_t  flags;
+  float    v[4];
+};
+
+LogRecord logRing[LOG_RING];
+volatile uint32_t logHead = 0;      // records ever added
+volatile uint32_t logTail = 0;      // records ever written
+volatile uint32_t logDropped = 0;
+volatile uint32_t logLastAdd = 0;   // time of the newest record
+volatile bool logEnabled = false;
+volatile bool turnRunning = false;  // set by rotateToHeadingPID
+volatile bool logWindow = false;    // a turn that can take a block write now
+volatile bool strokeRunning = false; // forward stroke in progress
+
+// starts a new log file, does nothing without an sd card
+void startFlightLog()
+{
+  if (!Brain.SDcard.isInserted()) return;
+  LogHeader header = {LOG_MAGIC, LOG_VERSION, (uint16_t)sizeof(LogRecord)};
+  logEnabled = Brain.SDcard.savefile(LOG_FILE, (uint8_t *)&header,
+                                     sizeof(header)) == (int32_t)sizeof(header);
+}
+
+void logRecord(uint8_t type, float a, float b, float c, float d,
+               int8_t left = 0, int8_t right = 0, uint8_t flags = 0)
+{
+  if (!logEnabled) return;
+  if (logHead - logTail >= (uint32_t)LOG_RING)
+  {
+    logDropped++;
+    return;
+  }
+
+  LogRecord &r = logRing[logHead % LOG_RING];
+  r.time = timer::system();
+  r.type = type;
+  r.left = left;
+  r.right = right;
+  r.flags = flags;
+  r.v[0] = a;
+  r.v[1] = b;
+  r.v[2] = c;
+  r.v[3] = d;
+  logLastAdd = r.time;
+  logHead++;
+}
+
+int logTask()
+{
+  while (true)
+  {
+    uint32_t queued = logHead - logTail;
+    bool quiet = (!turnRunning || logWindow) && !strokeRunning;
+    bool idle = timer::system() - logLastAdd >= (uint32_t)LOG_IDLE_MS;
+
+    if (logEnabled && quiet && (queued >= (uint32_t)LOG_BLOCK || (queued > 0 && idle)))
+    {
+      // one write per block, never past the end of the ring
+      uint32_t start = logTail % LOG_RING;
+      uint32_t count = queued < (uint32_t)LOG_BLOCK ? queued : (uint32_t)LOG_BLOCK;
+      if (start + count > (uint32_t)LOG_RING) count = LOG_RING - start;
+
+      Brain.SDcard.appendfile(LOG_FILE, (uint8_t *)&logRing[start],
+                              (int32_t)(count * sizeof(LogRecord)));
+      logTail += count;
+
+      if (logDropped > 0)
+      {
+        logRecord(REC_DROPPED, (float)logDropped, 0.0f, 0.0f, 0.0f);
+        logDropped = 0;
+      }
+    }
+    wait(20, msec);
+  }
+  return 0;
+}
+
+// ---------------------- battery compensation
+// as the battery drains over a night the motors have less torque. their own
+// velocity loop still holds a steady speed, but breakaway, acceleration and
+// small corrections get weaker, so turns settle slower. those parts of a
+// command are scaled up by full / measured voltage to act like they did on
+// the full pack we tuned with. scaling the whole velocity % would make the
+// robot outrun its turn profile instead, and the dispenser roller only
+// ever asks for a speed, so it's left alone.
+// the voltage dips under load, so it's only read when a move starts and
+// then filtered. every card out is logged with the voltage so flightlog
+// can show throughput against it.
+const float BATTERY_FULL   = 8.2f;   // volts, gains were tuned at this
+const float BATTERY_LOW    = 6.8f;   // scale stops growing below this
+const float BATTERY_FILTER = 0.2f;   // share of each new reading
+
+float batteryVolts = 0.0f;  // filtered, 0 until the first reading
+float batteryScale = 1.0f;  // multiplier for motor commands
+uint32_t lastCardTime = 0;  // for REC_CARD
+
+void updateBatteryScale()
+{
+  float v = (float)Brain.Battery.voltage(volt);
+  if (batteryVolts <= 0.0f) batteryVolts = v;
+  else batteryVolts += BATTERY_FILTER * (v - batteryVolts);
+
+  float v2 = batteryVolts < BATTERY_LOW ? BATTERY_LOW : batteryVolts;
+  batteryScale = v2 < BATTERY_FULL ? BATTERY_FULL / v2 : 1.0f;
+}
+
+// a % that's pushing rather than asking for a speed, never past 100
+float compensate(float power)
+{
+  float scaled = power * batteryScale;
+  if (scaled > 100.0f) return 100.0f;
+  if (scaled < -100.0f) return -100.0f;
+  return scaled;
+}
+
+void logCardOut(float heading)
+{
+  uint32_t now = timer::system();
+  uint32_t gap = lastCardTime == 0 ? 0 : now - lastCardTime;
+  lastCardTime = now;
+  logRecord(REC_CARD, batteryVolts, batteryScale, heading, (float)gap);
+}
+
+// ---------------------- dispense one card
+const float  DEG_PER_CARD = 240.0f;   // max degrees of rotation per card
+const int    MAX_MS = 240;            // max time for motor to run
+const float  CARD_EXIT_DEG = 100.0f;  // roller travel when the card leaves
+const int    CARD_EXIT_MS = 180;      // time from stroke start to card leaving,
+                                      // until it's been measured
+const float  EJECT_FILTER = 0.25f;    // share of each new latency sample
+const float  ROLLER_PCT = 90.0f;      // roller speed, held by the motor at any
+                                      // battery voltage, so not compensated:
+                                      // the eject timing depends on it
+
+// burst: several cards to one seat in a single forward stroke, one retract.
+// the next card sits where the last one started so it leaves CARD_PITCH_DEG
+// further on. the ejection check counts them out, and the stroke stops as
+// soon as it has seen them all, or BURST_TAIL_DEG past where the last one
+// should have gone if it missed one, well short of the card after it.
+bool burstDispensing = true;
+const float  CARD_PITCH_DEG = 100.0f;  // roller travel between cards out
+const float  BURST_TAIL_DEG = 40.0f;
+const int    BURST_MS_PER_CARD = 200;  // time limit per extra card
+
+// the forward stroke is split into start / update / finish so it can run
+// while rotateToHeadingPID is still finishing a turn (dispense on approach)
+int   strokeCards = 1;        // cards this stroke pushes out
+int   strokeCardsOut = 0;     // cards recorded as out so far
+float strokeExitMs = -1.0f;   // encoder timed exit of the first card, kept
+                              // for ejectLatencyMs once a card is seen
+float strokeStart = 0.0f;     // dispenser position at start of the stroke
+float strokePeakAmps = 0.0f;  // for the flight recorder
+timer strokeTimer;
+float seatTarget = 0.0f;      // heading the current card is meant for
+float ejectLatencyMs = CARD_EXIT_MS;  // measured stroke start to card out
+int   ejectSamples = 0;
+
+void recordCardExit(float target, float heading);
+float cardLanding();
+int getCardColor();
+
+// ---------------------- ejection check
+// the encoder only says how far the roller turned, not what left the tray.
+// as a card's trailing edge clears the tray the optical sensor sees a short
+// brightness dip, and while a card is being pushed the roller draws extra
+// current: about twice as much when two stick together, next to none when
+// it slips. each dip closes one card and the current since the last dip
+// says if it was one or two. a stroke with no dip at all counts as a slip
+// if the current was low too, otherwise the sensor just missed it.
+const float EDGE_DIP = 0.7f;         // dip = below this share of the brightness
+                                     // at stroke start...
+const float EDGE_CLEAR = 0.9f;       // ...until back above this share, so noise
+                                     // inside one dip isn't two
+const float CARD_AMPS_LOW  = 0.3f;   // pushing with less than this = slipping
+const float CARD_AMPS_HIGH = 0.7f;   // more than this = two cards
+const float AMPS_SKIP_DEG  = 60.0f;  // roller is still speeding up before this
+                                     // (see updateDispenseStroke)
+
+float strokeBright = 0.0f;    // tray brightness when the stroke started
+bool  strokeDipping = false;
+float strokeAmpSum = 0.0f;    // since the last dip
+int   strokeAmpCount = 0;
+float strokeAmpAll = 0.0f;    // whole stroke, for a stroke without a dip
+int   strokeAmpAllCount = 0;
+int   strokeCardsSeen = 0;    // cards the check counted this stroke
+int   cardsSlipped = 0;       // since resetSeatAccuracy()
+int   cardsDoubled = 0;
+
+void startEjectionCheck()
+{
+  // a few reads, one noisy high one would make every read after it a dip
+  strokeBright = 0.0f;
+  for (int i = 0; i < 8; i++) strokeBright += (float)OpticalSensor.brightness() / 8.0f;
+  strokeDipping = false;
+  strokeAmpSum = 0.0f;
+  strokeAmpCount = 0;
+  strokeAmpAll = 0.0f;
+  strokeAmpAllCount = 0;
+  strokeCardsSeen = 0;
+}
+
+// pushing = the roller is at speed on a card, so its current means something
+void updateEjectionCheck(bool pushing, float amps)
+{
+  if (pushing)
+  {
+    strokeAmpSum += amps;
+    strokeAmpCount++;
+    strokeAmpAll += amps;
+    strokeAmpAllCount++;
+  }
+
+  float bright = (float)OpticalSensor.brightness();
+  bool dip = bright < (strokeDipping ? EDGE_CLEAR : EDGE_DIP) * strokeBright;
+  if (dip && !strokeDipping)
+  {
+    bool two = strokeAmpCount > 0 && strokeAmpSum / strokeAmpCount > CARD_AMPS_HIGH;
+    strokeCardsSeen += two ? 2 : 1;
+    strokeAmpSum = 0.0f;
+    strokeAmpCount = 0;
+  }
+  strokeDipping = dip;
+}
+
+// the card being pushed jammed, the current so far says nothing about it
+void forgetCardAmps()
+{
+  strokeAmpSum = 0.0f;
+  strokeAmpCount = 0;
+  strokeAmpAll = 0.0f;
+  strokeAmpAllCount = 0;
+}
+
+// at the end of the stroke, returns LOG_SLIP / LOG_DOUBLE for the flight log
+uint8_t finishEjectionCheck(int expected)
+{
+  if (strokeCardsSeen == 0 && strokeAmpAllCount > 0
+      && strokeAmpAll / strokeAmpAllCount >= CARD_AMPS_LOW)
+  {
+    strokeCardsSeen = 1;  // pushed a card, the dip was missed
+  }
+
+  uint8_t flags = 0;
+  if (strokeCardsSeen < expected)
+  {
+    cardsSlipped += expected - strokeCardsSeen;
+    flags |= LOG_SLIP;
+  }
+  if (strokeCardsSeen > expected)
+  {
+    cardsDoubled += strokeCardsSeen - expected;
+    flags |= LOG_DOUBLE;
+  }
+  return flags;
+}
+
+// ---------------------- jam recovery
+// a jammed card stops the roller dead: it draws stall current and torque
+// while the encoder hardly moves. after JAM_CONFIRM_MS of that the stroke
+// backs the roller off so the card can straighten, then pushes again, up to
+// strokeRefeeds times. a jam that won't clear ends the stroke without a card,
+// which the ejection check turns into a re-deal. each jam is logged with
+// what it cost, from the roller stalling to getting past it (or giving up).
+const float JAM_DPS  = 120.0f;       // slower than this...
+const float JAM_AMPS = 0.8f;         // ...while drawing more than this
+const float JAM_NM   = 0.28f;        // or pushing harder than this is a stall
+const int   JAM_SETTLE_MS = 60;      // roller is still speeding up before this
+const int   JAM_CONFIRM_MS = 30;     // stalled this long = jammed
+const float JAM_BACKOFF_DEG = 40.0f;
+const int   JAM_BACKOFF_MS = 150;    // back-off move time limit
+const float JAM_PAST_DEG = 10.0f;    // this far past where it stuck = cleared
+const int   JAM_REFEEDS = 2;         // pushes again before giving up
+const int   JAM_REFEED_MS = 100;     // stroke time added per re-feed, to win
+                                     // back the back-off
+
+int   strokeRefeeds = JAM_REFEEDS;  // re-feeds this stroke may use
+float strokeLimitMs = MAX_MS;       // stroke time limit, grows per re-feed
+float strokeSpinUp = 0.0f;          // stroke ms the roller last started forward
+float strokeStalledAt = -1.0f;      // stroke ms the stall began, -1 = none
+bool  strokeBackingOff = false;
+float strokeBackoffStart = 0.0f;
+float strokeLostFrom = 0.0f;        // stall start of the back-off under way
+bool  strokeJammed = false;         // a jam not yet cleared or given up on
+float strokeJamStart = 0.0f;
+float strokeJamTravel = 0.0f;       // roller travel where it stuck
+float strokeJamAmps = 0.0f;
+float strokeJamNm = 0.0f;
+int   strokeJamTries = 0;           // re-feeds used on it
+int   jamsCleared = 0;              // since resetSeatAccuracy()
+int   jamsStuck = 0;
+float jamMsLost = 0.0f;
+
+void logJam(bool cleared, float now)
+{
+  float lost = now - strokeJamStart;
+  jamMsLost += lost;
+  if (cleared) jamsCleared++;
+  else jamsStuck++;
+  logRecord(REC_JAM, strokeJamTravel, lost, strokeJamAmps, strokeJamNm,
+            (int8_t)strokeJamTries, 0, cleared ? 0 : LOG_JAM_STUCK);
+  strokeJammed = false;
+}
+
+// called every stroke update. returns true when it gave up on a jam and the
+// stroke should end, otherwise false; strokeBackingOff says a back-off started
+bool checkJam(float now, float travel, float amps)
+{
+  if (strokeJammed && travel > strokeJamTravel + JAM_PAST_DEG)
+  {
+    logJam(true, now);  // pushed past where it stuck
+  }
+
+  float speed = (float)MotorDispense.velocity(dps);
+  bool stalled = now - strokeSpinUp >= JAM_SETTLE_MS && speed < JAM_DPS
+                 && (amps > JAM_AMPS || (float)MotorDispense.torque(Nm) > JAM_NM);
+  if (!stalled)
+  {
+    strokeStalledAt = -1.0f;
+    return false;
+  }
+  if (strokeStalledAt < 0.0f) strokeStalledAt = now;
+  if (now - strokeStalledAt < JAM_CONFIRM_MS) return false;
+
+  if (!strokeJammed)
+  {
+    strokeJammed = true;
+    strokeJamStart = strokeStalledAt;
+    strokeJamTravel = travel;
+    strokeJamAmps = amps;
+    strokeJamNm = (float)MotorDispense.torque(Nm);
+    strokeJamTries = 0;
+  }
+  forgetCardAmps();
+  if (strokeJamTries >= strokeRefeeds) return true;
+
+  strokeJamTries++;
+  strokeLostFrom = strokeStalledAt;
+  strokeStalledAt = -1.0f;
+  strokeBackingOff = true;
+  strokeBackoffStart = now;
+  MotorDispense.spinFor(reverse, JAM_BACKOFF_DEG, deg, false);
+  return false;
+}
+
+// ---------------------- background retract
+// the retract stroke runs on retractTask's thread so the robot can already
+// turn to the next seat. retracting is the interlock: no new stroke starts
+// until it's false again.
+// the roller goes back to a fixed encoder home instead of reversing for a
+// set time, so its position can't drift over a session and the stroke ends
+// as soon as it gets there.
+const float RETRACT_TOLERANCE = 5.0f;  // degrees from home counts as home
+const int   RETRACT_MAX_MS = 500;      // give up if it never gets home,
+                                       // per DEG_PER_CARD of travel back
+
+float dispenserHome = 0.0f;  // roller position between strokes, zeroed in
+                             // configureAllSensors()
+volatile bool retracting = false;
+int retractMaxMs = RETRACT_MAX_MS;
+timer retractTimer;
+
+int retractTask()
+{
+  while (true)
+  {
+    if (retracting && emergencyStop)
+    {
+      retracting = false;
+    }
+    else if (retracting
+        && (fabsf((float)MotorDispense.position(deg) - dispenserHome) < RETRACT_TOLERANCE
+            || retractTimer.time(msec) >= retractMaxMs))
+    {
+      MotorDispense.stop(brake);
+      retracting = false;
+    }
+    wait(5, msec);
+  }
+  return 0;
+}
+
+void startRetract()
+{
+  if (emergencyStop) return;
+  float back = fabsf((float)MotorDispense.position(deg) - dispenserHome);
+  retractMaxMs = RETRACT_MAX_MS * (1 + (int)(back / DEG_PER_CARD));
+  retractTimer.clear();
+  retracting = true;
+  MotorDispense.setVelocity(ROLLER_PCT, percent);  // same as forward
+  MotorDispense.spinToPosition(dispenserHome, deg, false);
+}
+
+void waitForRetract()
+{
+  uint32_t start = timer::system();
+  while (retracting)
+  {
+    wait(5, msec);
+  }
+  recordPhase(PHASE_RETRACT, timer::system() - start);
+}
+
+// refeeds: how often a jam is backed off and pushed again before the stroke
+// gives up on the card
+void startDispenseStroke(int cards = 1, int refeeds = JAM_REFEEDS)
+{
+  waitForRetract();
+  if (emergencyStop) return;
+  strokeStart = (float)MotorDispense.position(deg);
+  strokeRunning = true;
+  strokeCards = cards < 1 ? 1 : cards;
+  strokeCardsOut = 0;
+  strokeExitMs = -1.0f;
+  strokeRefeeds = refeeds;
+  strokeLimitMs = (float)(MAX_MS + (strokeCards - 1) * BURST_MS_PER_CARD);
+  strokeSpinUp = 0.0f;
+  strokeStalledAt = -1.0f;
+  strokeBackingOff = false;
+  strokeJammed = false;
+  startEjectionCheck();
+  strokePeakAmps = 0.0f;
+  strokeTimer.clear();
+  updateBatteryScale();
+  MotorDispense.setVelocity(ROLLER_PCT, percent);
+  MotorDispense.spin(forward);
+}
+
+// records each card the ejection check has seen leave since last time.
+// a slip never gets here, so it isn't counted as dealt
+void noteCardsOut()
+{
+  if (strokeCardsOut == 0 && strokeCardsSeen > 0 && strokeExitMs >= 0.0f)
+  {
+    if (ejectSamples == 0) ejectLatencyMs = strokeExitMs;
+    else ejectLatencyMs += EJECT_FILTER * (strokeExitMs - ejectLatencyMs);
+    ejectSamples++;
+  }
+  while (strokeCardsOut < strokeCardsSeen)
+  {
+    strokeCardsOut++;
+    recordCardExit(seatTarget, cardLanding());
+    logCardOut((float)BrainInertial.heading(degrees));
+  }
+}
+
+// checks the stroke once, returns true when the forward stroke is over
+bool updateDispenseStroke()
+{
+  if (!strokeRunning) return true;
+  if (emergencyStop)
+  {
+    strokeRunning = false; // motor is already braked
+    return true;
+  }
+
+  float now = (float)strokeTimer.time(msec);
+  if (strokeBackingOff)
+  {
+    // let the back-off finish, then push again from there
+    if (!MotorDispense.isDone() && now - strokeBackoffStart < JAM_BACKOFF_MS) return false;
+    strokeBackingOff = false;
+    strokeSpinUp = now;
+    strokeLimitMs += now - strokeLostFrom + JAM_REFEED_MS;
+    MotorDispense.setVelocity(ROLLER_PCT, percent);
+    MotorDispense.spin(forward);
+    return false;
+  }
+
+  float travel = (float)MotorDispense.position(deg) - strokeStart;
+  float amps = (float)MotorDispense.current(amp);
+  if (amps > strokePeakAmps) strokePeakAmps = amps;
+  bool gaveUp = checkJam(now, travel, amps);
+  if (strokeBackingOff) return false;
+  updateEjectionCheck(travel >= AMPS_SKIP_DEG && now - strokeSpinUp >= JAM_SETTLE_MS
+                      && strokeStalledAt < 0.0f, amps);
+  // the encoder times the eject (it went out a little before we looked,
+  // back that off at roller speed), only a stroke that ran straight
+  // through counts
+  if (strokeExitMs < 0.0f && strokeSpinUp == 0.0f && travel >= CARD_EXIT_DEG)
+  {
+    strokeExitMs = now;
+    float speed = fabsf((float)MotorDispense.velocity(dps));
+    if (speed > 1.0f) strokeExitMs -= (travel - CARD_EXIT_DEG) / speed * 1000.0f;
+  }
+  noteCardsOut();
+
+  bool done = gaveUp || now >= strokeLimitMs;
+  if (strokeCards == 1)
+  {
+    done = done || travel >= DEG_PER_CARD;
+  }
+  else
+  {
+    float last = CARD_EXIT_DEG + (strokeCards - 1) * CARD_PITCH_DEG;
+    done = done || strokeCardsSeen >= strokeCards || travel >= last + BURST_TAIL_DEG;
+  }
+
+  if (done)
+  {
+    MotorDispense.stop(brake);
+    if (strokeJammed) logJam(false, now);
+    recordPhase(PHASE_DISPENSE, (uint32_t)strokeTimer.time(msec));
+    uint8_t flags = finishEjectionCheck(strokeCards);
+    noteCardsOut();  // one the check only knows from the current
+    logRecord(REC_STROKE, strokeStart, strokeStart + travel,
+              (float)strokeTimer.time(msec), strokePeakAmps,
+              (int8_t)strokeCardsSeen, 0, flags);
+    strokeRunning = false;  // logTask may write the stroke's records now
+  }
+  return !strokeRunning;
+}
+
+// waits out the forward stroke then starts the retract stroke, which
+// finishes in the background
+void finishDispenseStroke()
+{
+  while (!updateDispenseStroke())
+  {
+    wait(1, msec); // lets estopTask and the retract thread run
+  }
+
+  startRetract();
+}
+
+void dispenseOneCard()
+{
+  startDispenseStroke();
+  finishDispenseStroke();
+}
+
+void dispenseBurst(int cards)
+{
+  startDispenseStroke(cards);
+  finishDispenseStroke();
+}
+
+// ---------------------- control math
+// the brain's cortex-m4 only has a single precision fpu (-mfpu=fpv4-sp-d16),
+// so any double math turns into slow soft-float library calls. everything in
+// the control loop and the color check stays in float (note the f suffixes).
+
 // ---------------------- pid rotation functions
-double clamp(double power, double minPower, double maxPower)
+float clamp(float power, float minPower, float maxPower)
 {
-  double temp = fabs(power);
+  float temp = fabsf(power);
   if (temp < minPower) temp = minPower; // corrects if the current power is
   if (temp > maxPower) temp = maxPower; // outside of our limits
-  return copysign(temp, power);
+  return copysignf(temp, power);
 }
 
-double convertAngle(double angle)
+float convertAngle(float angle)
 {
-  while (angle > 180.0) angle -= 360.0;
-  while (angle < -180.0) angle += 360.0; // makes a within -180 to 180 
+  while (angle > 180.0f) angle -= 360.0f;
+  while (angle < -180.0f) angle += 360.0f; // makes a within -180 to 180 
   return angle;
 }
 
-bool rotateToHeadingPID(double target)
+// ---------------------- turn motion profile
+// trapezoidal velocity profile for a turn: speed up at TURN_ACCEL, cruise at
+// TURN_MAX_VEL, slow down at TURN_ACCEL. short turns (36 deg for 10 players)
+// never reach cruise speed and become a triangle instead.
+const float TURN_MAX_VEL = 170.0f;    // peak turn rate (deg/s)
+const float TURN_ACCEL   = 900.0f;    // turn acceleration (deg/s^2)
+
+// feedforward: motor power needed to follow the profile
+const float kV = 0.35f;               // % power per deg/s
+const float kA = 0.021f;              // % power per deg/s^2
+
+// dispense on approach: the card may start feeding before the turn ends as
+// long as the profile says we'll be this close and this slow when it exits
+bool dispenseOnApproach = true;
+const float APPROACH_TOLERANCE = 2.0f;  // degrees off the seat at card exit
+const float APPROACH_MAX_RATE = 20.0f;  // deg/s at card exit
+
+struct TurnProfile
+{
+  float distance;    // signed degrees to turn, + is clockwise
+  float peakVel;     // fastest turn rate reached (deg/s)
+  float accelTime;   // seconds spent speeding up (same for slowing down)
+  float cruiseTime;  // seconds at peakVel
+  float totalTime;   // seconds for the whole turn
+};
+
+TurnProfile planTurn(float distance, float maxVel = TURN_MAX_VEL)
+{
+  TurnProfile p;
+  float d = fabsf(distance);
+  p.distance = distance;
+  p.peakVel = maxVel;
+
+  // not enough room to reach max speed -> triangle profile
+  if (d < maxVel * maxVel / TURN_ACCEL)
+  {
+    p.peakVel = sqrtf(d * TURN_ACCEL);
+  }
+
+  p.accelTime = p.peakVel / TURN_ACCEL;
+  p.cruiseTime = 0.0f;
+  if (p.peakVel > 0.0f)
+  {
+    p.cruiseTime = (d - p.peakVel * p.accelTime) / p.peakVel;
+  }
+  p.totalTime = 2.0f * p.accelTime + p.cruiseTime;
+  return p;
+}
+
+// where the profile wants us to be at time t (s): angle, rate and acceleration
+void sampleTurn(const TurnProfile &p, float t, float &pos, float &vel, float &acc)
+{
+  float dir = p.distance < 0.0f ? -1.0f : 1.0f;
+  float ta = p.accelTime;
+  float tc = p.cruiseTime;
+
+  if (t <= 0.0f)
+  {
+    pos = 0.0f; vel = 0.0f; acc = 0.0f;
+  }
+  else if (t < ta)
+  {
+    acc = TURN_ACCEL;
+    vel = TURN_ACCEL * t;
+    pos = 0.5f * TURN_ACCEL * t * t;
+  }
+  else if (t < ta + tc)
+  {
+    acc = 0.0f;
+    vel = p.peakVel;
+    pos = 0.5f * p.peakVel * ta + p.peakVel * (t - ta);
+  }
+  else if (t < p.totalTime)
+  {
+    float td = t - ta - tc;   // time into slowing down
+    acc = -TURN_ACCEL;
+    vel = p.peakVel - TURN_ACCEL * td;
+    pos = 0.5f * p.peakVel * ta + p.peakVel * tc
+          + p.peakVel * td - 0.5f * TURN_ACCEL * td * td;
+  }
+  else
+  {
+    pos = fabsf(p.distance); vel = 0.0f; acc = 0.0f;
+  }
+
+  pos *= dir;
+  vel *= dir;
+  acc *= dir;
+}
+
+// ---------------------- turn gains
+// pid trim gains for rotateToHeadingPID. the autotune mode measures new ones
+// and saves them to the sd card, main() loads them at boot. without a card
+// (or a gains file) these defaults are used.
+const char *const GAINS_FILE = "gains.txt";
+
+const float DEFAULT_KP = 1.25f;
+const float DEFAULT_KI = 0.02f;
+const float DEFAULT_KD = 0.15f;
+
+float turnKp = DEFAULT_KP;
+float turnKi = DEFAULT_KI;
+float turnKd = DEFAULT_KD;
+// old values: 1.25, 0.0, 0.12 (josef10), 1.2, 0.0, 0.15 (v9)
+
+// gains file is one line of text, "kp ki kd", so it can be edited by hand
+bool loadTurnGains()
+{
+  if (!Brain.SDcard.isInserted() || !Brain.SDcard.exists(GAINS_FILE)) return false;
+
+  char text[64];
+  int32_t n = Brain.SDcard.loadfile(GAINS_FILE, (uint8_t *)text, sizeof(text) - 1);
+  if (n <= 0) return false;
+  text[n] = 0;
+
+  float kp, ki, kd;
+  if (sscanf(text, "%f %f %f", &kp, &ki, &kd) != 3) return false;
+  if (kp <= 0.0f || ki < 0.0f || kd < 0.0f) return false;
+  turnKp = kp;
+  turnKi = ki;
+  turnKd = kd;
+  return true;
+}
+
+bool saveTurnGains()
+{
+  if (!Brain.SDcard.isInserted()) return false;
+  char text[64];
+  int n = snprintf(text, sizeof(text), "%.4f %.4f %.4f\n",
+                   (double)turnKp, (double)turnKi, (double)turnKd);
+  return Brain.SDcard.savefile(GAINS_FILE, (uint8_t *)text, n) == n;
+}
+
+// ---------------------- gain schedule
+// one set of gains doesn't suit every turn: a 36 deg turn for 10 players
+// and a 180 deg turn for 2 need different power limits, and close to the
+// target the pid has to push harder to get past static friction instead of
+// creeping. the power limit is looked up by turn size once per turn, and
+// the turn gains above are multiplied by a table looked up by |error| every
+// loop. (per size gains made no difference in settle-bench, the feedforward
+// does the work until the error table takes over.) both tables are
+// interpolated between points and held flat past the ends.
+struct PowerPoint
+{
+  float size;      // deg
+  float maxPower;  // % motor power
+};
+
+const int NUM_SIZE_POINTS = 3;
+const PowerPoint sizeSchedule[NUM_SIZE_POINTS] =
+{
+  // size   maxPower
+  {  36.0f, 80.0f },
+  {  90.0f, 85.0f },
+  { 180.0f, 90.0f },
+};
+
+struct GainPoint
+{
+  float at;        // deg of |error|
+  float kp;        // multipliers on turnKp / turnKi / turnKd
+  float ki;
+  float kd;
+};
+
+const int NUM_ERROR_POINTS = 3;
+const GainPoint errorSchedule[NUM_ERROR_POINTS] =
+{
+  // |error| kp   ki     kd
+  {  1.0f, 4.00f, 60.0f, 1.00f },
+  {  4.0f, 1.50f, 10.0f, 1.00f },
+  { 10.0f, 1.00f,  1.00f, 1.00f },
+};
+
+float maxPowerFor(float size)
+{
+  const PowerPoint *table = sizeSchedule;
+  if (size <= table[0].size) return table[0].maxPower;
+  for (int i = 1; i < NUM_SIZE_POINTS; i++)
+  {
+    if (size <= table[i].size)
+    {
+      float f = (size - table[i - 1].size) / (table[i].size - table[i - 1].size);
+      return table[i - 1].maxPower + (table[i].maxPower - table[i - 1].maxPower) * f;
+    }
+  }
+  return table[NUM_SIZE_POINTS - 1].maxPower;
+}
+
+GainPoint scheduleAt(const GainPoint table[], int n, float x)
+{
+  if (x <= table[0].at) return table[0];
+  for (int i = 1; i < n; i++)
+  {
+    if (x <= table[i].at)
+    {
+      const GainPoint &a = table[i - 1];
+      const GainPoint &b = table[i];
+      float f = (x - a.at) / (b.at - a.at);
+      GainPoint g;
+      g.at = x;
+      g.kp = a.kp + (b.kp - a.kp) * f;
+      g.ki = a.ki + (b.ki - a.ki) * f;
+      g.kd = a.kd + (b.kd - a.kd) * f;
+      return g;
+    }
+  }
+  return table[n - 1];
+}
+
+// ---------------------- deadband learning
+// below some power the robot doesn't turn at all: static friction, more on
+// carpet, less on a smooth table, more as the battery sags, and not the same
+// cw and ccw. a fixed minPower either overshoots small corrections or
+// stalls them, so instead every push from rest is an experiment: push a
+// little under the learned breakaway power, add a ramp each tick until the
+// gyro sees it move, and move the estimate towards the power that did it.
+// turns start that way (the feedforward alone is far past breakaway on the
+// first tick, which says nothing), and so does every correction from rest
+// after a turn's profile. a ramped start costs a few ticks, so once each
+// way has START_LEARN_ALL onsets only one turn in START_EVERY ramps,
+// enough to follow the battery and the table.
+const float BREAKAWAY_START = 7.0f;  // % until it's learned (the old minPower)
+const float BREAKAWAY_LOW   = 1.0f;  // limits on the estimate
+const float BREAKAWAY_HIGH  = 30.0f;
+const float BREAKAWAY_PROBE = 1.0f;  // first push is this far under it
+const float BREAKAWAY_RAMP  = 0.5f;  // % more every tick it hasn't moved
+const float START_PROBE     = 0.5f;  // the same at the start of a turn
+const float START_RAMP      = 1.0f;
+const int   START_LEARN_ALL = 8;     // onsets each way before it ramps less
+const int   START_EVERY     = 8;     // then one turn in this many ramps
+const float BREAKAWAY_LEARN = 0.5f;  // how far one onset moves the estimate
+const float REST_RATE  = 2.0f;       // deg/s, at rest below this
+const float ONSET_RATE = 2.5f;       // deg/s, moving above this
+const int   ONSET_LAG  = 1;          // ticks from power out to the gyro seeing it
+                                     // (tick after next, from the sim model)
+
+float breakawayPower[2] = {BREAKAWAY_START, BREAKAWAY_START};  // [0] cw, [1] ccw
+uint32_t breakawayOnsets = 0;  // onsets learned from, for the summary page
+uint32_t startOnsets[2] = {0, 0};  // of those, at the start of a turn
+uint32_t restStarts[2] = {0, 0};   // turns started from rest
+
+struct DeadbandWatch
+{
+  bool starting;                  // the turn's first push, see rampFromRest
+  bool pushing;                   // pushing from rest, waiting for it to move
+  int dir;                        // 0 cw, 1 ccw
+  float push;                     // % power of the current push
+  int ticks;                      // ticks since the push started
+  float firstPush;
+  float history[ONSET_LAG + 1];   // |power| sent on recent ticks, [0] newest
+};
+
+void startDeadband(DeadbandWatch &w)
+{
+  w.starting = false;
+  w.pushing = false;
+  w.dir = 0;
+  w.push = 0.0f;
+  w.ticks = 0;
+  w.firstPush = 0.0f;
+  for (int i = 0; i <= ONSET_LAG; i++) w.history[i] = 0.0f;
+}
+
+// it's moving: the power that did it went out ONSET_LAG ticks ago, and
+// broke away somewhere in the last ramp step before that
+void learnOnset(DeadbandWatch &w, float ramp)
+{
+  float onset = w.ticks >= ONSET_LAG ? w.history[ONSET_LAG] - 0.5f * ramp : w.firstPush;
+  float &est = breakawayPower[w.dir];
+  est += BREAKAWAY_LEARN * (onset - est);
+  if (est < BREAKAWAY_LOW) est = BREAKAWAY_LOW;
+  if (est > BREAKAWAY_HIGH) est = BREAKAWAY_HIGH;
+  breakawayOnsets++;
+  if (w.starting) startOnsets[w.dir]++;
+  w.pushing = false;
+  w.starting = false;
+}
+
+// the start of a turn from rest: a ramp from just under the learned
+// breakaway until the gyro sees it move. the profile waits for it, so the
+// turn follows it from the onset instead of chasing a few ticks behind
+void startFromRest(DeadbandWatch &w, float distance, float rate)
+{
+  if (fabsf(rate) >= REST_RATE) return;
+  int dir = distance >= 0.0f ? 0 : 1;
+  restStarts[dir]++;
+  if (startOnsets[dir] >= START_LEARN_ALL && restStarts[dir] % START_EVERY != 0) return;
+  w.starting = true;
+  w.pushing = true;
+  w.dir = dir;
+  w.push = breakawayPower[w.dir] - START_PROBE;
+  if (w.push < BREAKAWAY_LOW) w.push = BREAKAWAY_LOW;
+  w.firstPush = w.push;
+  w.ticks = -1;  // counts from the first tick u gets up to the push
+}
+
+// power to send while starting; the tick it moves it keeps pushing, so the
+// profile picks it up still moving
+float rampFromRest(DeadbandWatch &w, float rate)
+{
+  float sign = w.dir == 0 ? 1.0f : -1.0f;
+  if (fabsf(rate) > ONSET_RATE)
+  {
+    if ((rate > 0.0f) == (w.dir == 0)) learnOnset(w, START_RAMP);
+    else w.starting = w.pushing = false;  // still drifting from before
+    return sign * w.push;
+  }
+  if (w.ticks >= 0) w.push += START_RAMP;
+  w.ticks++;
+  if (w.push > BREAKAWAY_HIGH) w.starting = w.pushing = false;  // stuck
+  for (int i = ONSET_LAG; i > 0; i--) w.history[i] = w.history[i - 1];
+  w.history[0] = w.push;
+  return sign * w.push;
+}
+
+// floor for |power| once the profile is over, u is the controller output
+float deadbandFloor(DeadbandWatch &w, float u, float rate)
+{
+  int dir = u >= 0.0f ? 0 : 1;
+  float floor = 0.0f;
+
+  if (fabsf(rate) < REST_RATE)
+  {
+    if (!w.pushing || w.dir != dir)
+    {
+      w.pushing = true;
+      w.dir = dir;
+      w.push = breakawayPower[dir] - BREAKAWAY_PROBE;
+      if (w.push < BREAKAWAY_LOW) w.push = BREAKAWAY_LOW;
+      w.firstPush = w.push;
+      w.ticks = 0;
+    }
+    else
+    {
+      w.push += BREAKAWAY_RAMP;
+      w.ticks++;
+    }
+    floor = w.push;
+  }
+  else if (w.pushing)
+  {
+    bool sameWay = (rate > 0.0f) == (w.dir == 0);
+    if (!sameWay || w.ticks < 2)
+    {
+      w.pushing = false;  // still drifting from before, learn nothing
+    }
+    else if (fabsf(rate) > ONSET_RATE)
+    {
+      learnOnset(w, BREAKAWAY_RAMP);
+    }
+    else
+    {
+      floor = w.push;     // starting to move, keep pushing
+    }
+  }
+
+  for (int i = ONSET_LAG; i > 0; i--) w.history[i] = w.history[i - 1];
+  w.history[0] = fabsf(u) > floor ? fabsf(u) : floor;
+  return floor;
+}
+
+// ---------------------- heading state
+// where the robot points and how fast it's turning, read together once per
+// control loop. the rate comes straight from the gyro, so the d term doesn't
+// have to difference two noisy angle samples over a loop time that may not
+// be what we asked for.
+const float GYRO_SIGN = 1.0f;     // gyroRate(zaxis) is + clockwise like heading
+const float SETTLE_RATE = 20.0f;  // deg/s, can brake to a stop from this
+const float BRAKE_TIME  = 0.05f;  // s, how far ahead the brake leaves us
+
+struct HeadingState
+{
+  float angle;  // rotation(), deg, doesn't wrap at 360
+  float rate;   // deg/s, + clockwise
+};
+
+void readHeadingState(HeadingState &h)
+{
+  h.angle = (float)BrainInertial.rotation(degrees);
+  h.rate = GYRO_SIGN * (float)BrainInertial.gyroRate(zaxis, dps);
+}
+
+uint32_t lastTurnMs = 0;    // whole of the last rotateToHeadingPID
+uint32_t lastSettleMs = 0;  // part of it after the profile ended
+
+// turns to target heading following planTurn()'s profile. feedforward does
+// most of the work, pid only trims the error from where the profile says we
+// should be, then holds the final heading until it's within tolerance and
+// has stopped turning (settled).
+// with startCards the dispenser stroke (for that many cards) is started
+// during the final approach, the caller finishes it with finishDispenseStroke()
+bool rotateToHeadingPID(float target, int startCards = 0)
 {
-  const double maxPower = 70.0;        // max motor power
-  const double minPower = 7.0;         // min motor power
-  const double integralLimit = 20.0;   // minimum degrees away from target
+  const float integralLimit = 20.0f;   // minimum degrees away from target
                                        // to start calculating integral
 
-  const int loopTime = 15;             // update frequency (in ms)
+  const int loopTime = 10;             // update frequency (in ms), the
+                                       // imu updates every 10 ms
 
-  double kp = 1.25;
-  double ki = 0.02;
-  double kd = 0.15;
   int timeout = 2000;
-  double tolerance = 1.0;
-  // old values: 1.25, 0.0, 0.12, 2000, 2.0
+  float tolerance = 1.0f;
+  // old values: 2000, 2.0
+
+  if (emergencyStop) return false;
+  turnRunning = true;
 
   MotorLeft.setStopping(brake);
   MotorRight.setStopping(brake);
   MotorLeft.spin(forward);
   MotorRight.spin(forward);
+  updateBatteryScale();
 
   timer t; // initializes timer t
-  
-  double error = convertAngle(target - BrainInertial.heading(degrees));
-  // converts target angle to a lowest angle to target
-  // IN DEGREES
-  // IN DEGREES
 
-  double prevError  = error;  // for derivative calc
-  double integral = 0.0;      // accumulated error over time (integral)
+  // rotation() doesn't wrap at 360 so it's safe to measure progress with
+  HeadingState h;
+  readHeadingState(h);
+  float start = h.angle;
+  float distance = convertAngle(target - (float)BrainInertial.heading(degrees));
+  TurnProfile profile = planTurn(distance);
+  float profileMs = profile.totalTime * 1000.0f;
+
+  // see gain schedule, maxPower was 70 for every turn
+  float maxPower = maxPowerFor(fabsf(distance));
+
+  float error = distance;        // degrees left to the target
+  float trackError = 0.0f;       // degrees behind the profile
+  float integral = 0.0f;         // ki * error summed over time, % power
+  float elapsed = 0.0f;          // ms since the turn started
+  float profileStart = 0.0f;     // ms, when it started moving
+  bool settled = false;
+
+  LoopClock clock;
+  startLoop(clock, loopTime, &turnLoopStats);
+  DeadbandWatch band;
+  startDeadband(band);
+  startFromRest(band, distance, h.rate);
+
+  // run the profile, then continue until settled or timeouts
+  while (!settled && elapsed < timeout && !emergencyStop)
+  {
+    if (band.starting) profileStart = elapsed;  // see deadband learning
+    float profileT = elapsed - profileStart;
+    float setPos, setVel, setAcc;
+    sampleTurn(profile, profileT / 1000.0f, setPos, setVel, setAcc);
+
+    float travelled = h.angle - start;
+    trackError = setPos - travelled;
+
+    GainPoint near = scheduleAt(errorSchedule, NUM_ERROR_POINTS,
+                                fabsf(distance - travelled));
+    float kp = turnKp * near.kp;
+    float ki = turnKi * near.ki;
+    float kd = turnKd * near.kd;
+
+    // INTEGRAL: RIEMANN'S SUM OF ERROR * TIME ELAPSED
+    // (over the time the loop really took, not loopTime)
+    float dt = clock.dt;
+    if (fabsf(trackError) < integralLimit)
+    // only start calculating integral as it approaches the limit
+    {
+        integral += ki * trackError * dt; // ki inside, so it can change
+    }
+    else
+    {
+        integral = 0.0f; // Reset integral when far from target
+    }
+
+    // DERIVATIVE: RATE OF CHANGE OF ERROR
+    // the profile's rate minus the gyro's, no differencing needed
+    float derivative = setVel - h.rate;
+
+    // FEEDFORWARD + PID TRIM
+    // pos u = cw rotation, neg u = ccw rotation
+    // the motors hold the kV speed themselves at any voltage, the rest
+    // is pushing against lag and friction and needs more on a low battery
+    float u = kV*setVel + batteryScale*(kA*setAcc
+              + kp*trackError + integral + kd*derivative);
+
+    // while following the profile the feedforward can ask for small power;
+    // once it's finished, the learned breakaway power makes sure corrections
+    // still move the robot (see deadband learning)
+    float powerFloor = 0.0f;
+    // (learned in full battery %, so the estimate doesn't drift as it drains)
+    if (band.starting) u = batteryScale * rampFromRest(band, h.rate);
+    else if (profileT >= profileMs)
+    {
+      powerFloor = batteryScale * deadbandFloor(band, u / batteryScale, h.rate);
+    }
+    float leftPower  = clamp( u, powerFloor, maxPower);
+    float rightPower = clamp(-u, powerFloor, maxPower);
+    MotorLeft.setVelocity(leftPower,  percent);
+    MotorRight.setVelocity(rightPower, percent);
+    logRecord(REC_TURN, start + travelled, trackError, integral, derivative,
+              (int8_t)roundf(leftPower), (int8_t)roundf(rightPower));
+
+    // start the card now if it'll come out on target
+    if (startCards > 0 && !strokeRunning && !retracting)
+    {
+      float exitPos, exitVel, exitAcc;
+      sampleTurn(profile, (profileT + ejectLatencyMs) / 1000.0f, exitPos, exitVel, exitAcc);
+      float exitError = distance - exitPos + trackError;
+      if (fabsf(exitError) < APPROACH_TOLERANCE && fabsf(exitVel) < APPROACH_MAX_RATE)
+      {
+        startDispenseStroke(startCards);
+        startCards = 0;
+      }
+    }
+    updateDispenseStroke();
+
+    waitForTick(clock); // sleeps until loopTime after the last tick
+
+    readHeadingState(h);
+    error = distance - (h.angle - start);
+    elapsed = (float)t.time(msec);
+
+    // done once the profile is over and braking now would leave us on
+    // target. looking at error alone brakes too late when still moving in
+    // and hunts back and forth around the target
+    float stopError = error - h.rate * BRAKE_TIME;
+    settled = elapsed - profileStart >= profileMs && fabsf(stopError) <= tolerance
+              && fabsf(h.rate) <= SETTLE_RATE;
+  }
+
+  MotorLeft.stop();
+  MotorRight.stop();
+
+  uint32_t turnMs = (uint32_t)t.time(msec);
+  float profileEnd = profileStart + profileMs;  // the start ramp counts as turning
+  uint32_t followMs = turnMs < profileEnd ? turnMs : (uint32_t)profileEnd;
+  recordPhase(PHASE_TURN, followMs);
+  recordPhase(PHASE_SETTLE, turnMs - followMs);
+  lastTurnMs = turnMs;
+  lastSettleMs = turnMs - followMs;
+
+  uint8_t flags = 0;
+  if (elapsed >= timeout) flags |= LOG_TIMED_OUT;
+  if (emergencyStop) flags |= LOG_ESTOP;
+  logRecord(REC_TURN_END, target, error, (float)turnMs, profileMs, 0, 0, flags);
+  turnRunning = false;
+
+  if (startCards > 0) startDispenseStroke(startCards); // never got close enough early
+  // (does nothing after an emergency stop)
+
+  // returns false if it failed to reach the target within timeout time
+  // (error itself can still be over tolerance while it brakes into place)
+  return settled;
+}
+
+// deal a set number of cards to a specific position, using rotation function 
+// + dispensing function(). returns how many really left (see ejection
+// check): a card that slipped is dealt again straight away, a double feed
+// can make it more than numCards
+const int MAX_REDEALS = 3;  // strokes that come up short per visit
+
+int dealCardsToPosition(float heading, int numCards) 
+{
+  seatTarget = heading;
+  int dealt = 0;
+  if (dispenseOnApproach && numCards > 0)
+  {
+    // first card is already on its way when the turn finishes, the rest of
+    // a burst follow once it's stopped
+    rotateToHeadingPID(heading, burstDispensing ? numCards : 1);
+    finishDispenseStroke();
+    dealt += strokeCardsSeen;
+    cardPause(80);
+  }
+  else
+  {
+    rotateToHeadingPID(heading);
+  }
+
+  // the rest and any that slipped, in a burst or one stroke per card
+  int shortStrokes = 0;
+  while (dealt < numCards && shortStrokes < MAX_REDEALS && !emergencyStop)
+  {
+    if (getCardColor() == 4) break; // tray is empty
+    int cards = burstDispensing ? numCards - dealt : 1;
+    dispenseBurst(cards);
+    if (strokeCardsSeen < cards) shortStrokes++;
+    dealt += strokeCardsSeen;
+    cardPause(80);
+  }
+  return dealt;
+}
+
+// ---------------------- per seat accuracy
+// heading error when each card leaves the tray, kept per seat so we can see
+// if dispensing on approach throws cards off target
+const int   MAX_SEATS = 10;
+const float MISDEAL_DEG = 5.0f;  // further off than this counts as a misdeal
+
+float seatHeading[MAX_SEATS];
+int   seatCards[MAX_SEATS];
+float seatErrorSum[MAX_SEATS];
+float seatErrorMax[MAX_SEATS];
+int   numSeatsSeen = 0;
+int   misdeals = 0;
+
+void resetSeatAccuracy()
+{
+  numSeatsSeen = 0;
+  misdeals = 0;
+  cardsSlipped = 0;
+  cardsDoubled = 0;
+  jamsCleared = 0;
+  jamsStuck = 0;
+  jamMsLost = 0.0f;
+}
+
+void recordCardExit(float target, float heading)
+{
+  float error = fabsf(convertAngle(target - heading));
+  if (error > MISDEAL_DEG) misdeals++;
+
+  // find this seat, or add it
+  int seat = 0;
+  while (seat < numSeatsSeen && seatHeading[seat] != target) seat++;
+  if (seat == numSeatsSeen)
+  {
+    if (numSeatsSeen == MAX_SEATS) return;
+    numSeatsSeen++;
+    seatHeading[seat] = target;
+    seatCards[seat] = 0;
+    seatErrorSum[seat] = 0.0f;
+    seatErrorMax[seat] = 0.0f;
+  }
+
+  seatCards[seat]++;
+  seatErrorSum[seat] += error;
+  if (error > seatErrorMax[seat]) seatErrorMax[seat] = error;
+}
+
+// shows mean/max heading error per seat, two seats per line
+void showSeatAccuracy()
+{
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("err avg/max, %d bad", misdeals);
+  for (int i = 0; i < numSeatsSeen; i++)
+  {
+    if (i % 2 == 0) Brain.Screen.newLine();
+    Brain.Screen.print("%d:%.1f/%.1f ", i,
+                       (double)(seatErrorSum[i] / seatCards[i]),
+                       (double)seatErrorMax[i]);
+  }
+  if (cardsSlipped > 0 || cardsDoubled > 0)
+  {
+    Brain.Screen.newLine();
+    Brain.Screen.print("%d slipped, %d doubled", cardsSlipped, cardsDoubled);
+  }
+  if (jamsCleared > 0 || jamsStuck > 0)
+  {
+    Brain.Screen.newLine();
+    Brain.Screen.print("%d jams (%d stuck) %.1f s", jamsCleared + jamsStuck, jamsStuck,
+                       (double)(jamMsLost / 1000.0f));
+  }
+}
+
+// ---------------------- sweep dealing
+// with many players most of a deal is stopping and starting at each seat.
+// a sweep deal turns clockwise at a constant rate instead and starts each
+// stroke a lead angle before the seat, so the card lands on it while the
+// robot keeps turning:
+//   lead = rate * (eject latency + card flight)
+// the eject latency (stroke start to card out) is measured off the roller
+// encoder on every stroke. calibrateSweep() deals the first card standing
+// still to measure it and the dispenser's full cycle, then the rate is
+// picked so the dispenser is ready again by the next seat. a card it wasn't
+// ready for, or that slipped, is dealt stopped once the sweep is over; a
+// seat that got a double feed is skipped the next time round.
+// the dispenser cycle (~520 ms) is the limit either way, so with 10 seats
+// stopping at each one already keeps up with it and the sweep isn't used.
+bool sweepDealing = true;
+const int   SWEEP_MAX_PLAYERS = 9;
+const float SWEEP_MAX_RATE = 150.0f;  // deg/s
+const float SWEEP_MAX_POWER = 90.0f;
+const float SWEEP_MARGIN = 1.05f;     // seat to seat = dispenser cycle * this
+const float SWEEP_TOLERANCE = 1.0f;   // deg a card may land past its seat
+const float CARD_FLIGHT_MS = 60.0f;   // card out to landing, the robot
+                                      // can't see this, so it's a guess
+const float IMU_LAG = 0.005f;         // s, average age of a heading read
+
+uint32_t dispenseCycleMs = 0;  // stroke start to roller home, calibrateSweep()
+
+// where the card that's leaving now lands, for the seat accuracy: it's
+// still in the air for CARD_FLIGHT_MS while the robot turns (the lead a
+// sweep gives each seat), and the heading read is IMU_LAG old
+float cardLanding()
+{
+  float rate = GYRO_SIGN * (float)BrainInertial.gyroRate(zaxis, dps);
+  return (float)BrainInertial.heading(degrees) + rate * (IMU_LAG + CARD_FLIGHT_MS / 1000.0f);
+}
+
+// first card of a sweep, standing still at heading
+void calibrateSweep(float heading)
+{
+  rotateToHeadingPID(heading);
+  seatTarget = heading;
+  uint32_t start = timer::system();
+  dispenseOneCard();  // updates ejectLatencyMs
+  waitForRetract();
+  dispenseCycleMs = timer::system() - start;
+}
+
+// deals cardsPer to each of players seats in one clockwise sweep, starting
+// at seat 0 (heading 0)
+void sweepDeal(int players, int cardsPer)
+{
+  const int loopTime = 10;
+  const float integralLimit = 20.0f;
+
+  int total = players * cardsPer;
+  if (total <= 0 || players > MAX_SEATS || emergencyStop) return;
+  float spacing = 360.0f / players;
+
+  // checked after every stroke (see ejection check)
+  int missed[MAX_SEATS];  // owed a card, dealt stopped after the sweep
+  int extra[MAX_SEATS];   // got one too many from a double feed
+  for (int i = 0; i < players; i++)
+  {
+    missed[i] = 0;
+    extra[i] = 0;
+  }
+
+  calibrateSweep(0.0f);
+  if (strokeCardsSeen == 0) missed[0]++;
+  else extra[0] += strokeCardsSeen - 1;
+  if (emergencyStop) return;
+  if (total == 1)
+  {
+    if (missed[0] > 0) dealCardsToPosition(0.0f, 1);
+    return;
+  }
+
+  float rate = spacing * 1000.0f / (dispenseCycleMs * SWEEP_MARGIN);
+  if (rate > SWEEP_MAX_RATE) rate = SWEEP_MAX_RATE;
+
+  turnRunning = true;
+  MotorLeft.setStopping(brake);
+  MotorRight.setStopping(brake);
+  MotorLeft.spin(forward);
+  MotorRight.spin(forward);
+  updateBatteryScale();
+
+  // card k goes to seat k % players, k * spacing on from seat 0. the
+  // sweep ends half way to the seat after the last card
+  HeadingState h;
+  readHeadingState(h);
+  float start = h.angle;
+  float offset = convertAngle((float)BrainInertial.heading(degrees));
+  TurnProfile profile = planTurn((total - 1) * spacing + spacing / 2.0f - offset, rate);
+  float profileMs = profile.totalTime * 1000.0f;
+
+  int next = 1;            // next card to start
+  bool stroking = false;   // a sweep stroke is running
+  int strokeSeat = 0;
+  float integral = 0.0f;
+  float trackError = 0.0f;
+  float elapsed = 0.0f;
+  float seatStart = 0.0f;  // ms the last stroke started, seat to seat is
+                           // this sweep's PHASE_TURN
+
+  LoopClock clock;
+  startLoop(clock, loopTime, &turnLoopStats);
+  timer t;
 
-  // continue until within tolerance or timeouts
-  while (fabs(error) > tolerance && t.time(msec) < timeout)
+  while ((elapsed < profileMs || stroking) && !emergencyStop)
   {
-    // INTEGRAL: RIEMANN'S SUM OF ERROR * TIME ELAPSED
-    if (fabs(error) < integralLimit)
-    // only start calculating integral as it approaches the limit
+    float setPos, setVel, setAcc;
+    sampleTurn(profile, elapsed / 1000.0f, setPos, setVel, setAcc);
+    // at sweep speed the half sample the imu is behind matters
+    trackError = setPos - (h.angle + h.rate * IMU_LAG - start);
+
+    if (fabsf(trackError) < integralLimit) integral += turnKi * trackError * clock.dt;
+    else integral = 0.0f;
+
+    // same feedforward + trim as rotateToHeadingPID, without the schedules:
+    // there's no target to slow down for until the very end
+    float u = kV*setVel + batteryScale*(kA*setAcc + turnKp*trackError
+              + integral + turnKd*(setVel - h.rate));
+    float power = clamp(u, 0.0f, SWEEP_MAX_POWER);
+    MotorLeft.setVelocity(power, percent);
+    MotorRight.setVelocity(-power, percent);
+    logRecord(REC_TURN, h.angle, trackError, integral, setVel - h.rate,
+              (int8_t)roundf(power), (int8_t)roundf(-power));
+    logWindow = false;
+
+    // where the next card lands if its stroke starts now
+    if (next < total && extra[next % players] > 0)
     {
-        integral += error * (loopTime/1000.0);
+      extra[next % players]--;  // already has this one
+      next++;
     }
-    else
+    else if (next < total)
     {
-        integral = 0.0; // Reset integral when far from target
-    }
-
-    // DERIVATIVE: RATE OF CHANGE OF ERROR
-    double derivative = (error - prevError) / (loopTime/1000.0);
-
-    // PID CALCULATION
-    // pos u = cw rotation, neg u = ccw rotation
-    double u = kp*error + ki*integral + kd*derivative;
+      float seat = next * spacing - offset;
+      float exitPos, exitVel, exitAcc;
+      sampleTurn(profile, (elapsed + ejectLatencyMs) / 1000.0f, exitPos, exitVel, exitAcc);
+      float landing = exitPos - trackError + exitVel * CARD_FLIGHT_MS / 1000.0f;
+      float togo = seat - landing;
 
-    // uses clamp() to make sure u is within min max values for power
-    double leftPower  = clamp( u, minPower, maxPower);
-    double rightPower = clamp(-u, minPower, maxPower);
-
-    MotorLeft.setVelocity(leftPower,  percent);
-    MotorRight.setVelocity(rightPower, percent);
-
-    wait(loopTime, msec); // waits until next loop of while loop, based on
-    //                     set value for loopDt
+      if (togo < -SWEEP_TOLERANCE)
+      {
+        missed[next % players]++;  // dispenser wasn't ready, deal it later
+        next++;
+      }
+      else if (!stroking && !retracting && exitVel > 0.0f
+               && togo < exitVel * loopTime / 1000.0f)
+      {
+        // lands before the next tick: wait the last few ms out here
+        if (togo > 0.0f) this_thread::sleep_for((uint32_t)(togo / exitVel * 1000.0f));
+        strokeSeat = next % players;
+        seatTarget = 360.0f / players * strokeSeat;
+        startDispenseStroke(1, 0);  // a re-fed card would land seats late
+        stroking = true;
+        next++;
+        float now = (float)t.time(msec);
+        recordPhase(PHASE_TURN, (uint32_t)(now - seatStart));
+        seatStart = now;
+      }
+      else if (!stroking && exitVel > 0.0f)
+      {
+        // a block write now is over before this stroke has to start
+        logWindow = togo > exitVel * (LOG_WRITE_MS + loopTime) / 1000.0f;
+      }
+    }
+    if (stroking && updateDispenseStroke())
+    {
+      startRetract();
+      stroking = false;
+      if (strokeCardsSeen == 0) missed[strokeSeat]++;
+      else extra[strokeSeat] += strokeCardsSeen - 1;
+    }
 
-    prevError = error; // stores current error for next derivative calculation
-    error = convertAngle(target - BrainInertial.heading(degrees)); 
-    // get new error
+    waitForTick(clock);
+    readHeadingState(h);
+    elapsed = (float)t.time(msec);
   }
 
   MotorLeft.stop();
   MotorRight.stop();
-
-  // returns false if it failed to reach the target within timeout time
-  return fabs(error) <= tolerance;
+  logWindow = false;
+  // the last seat to the end of the profile, then waiting on its stroke
+  float followMs = elapsed < profileMs ? elapsed : profileMs;
+  if (followMs > seatStart) recordPhase(PHASE_TURN, (uint32_t)(followMs - seatStart));
+  recordPhase(PHASE_SETTLE, (uint32_t)(elapsed - followMs));
+  uint8_t flags = emergencyStop ? LOG_ESTOP : 0;
+  logRecord(REC_TURN_END, profile.distance, trackError, elapsed, profileMs, 0, 0, flags);
+  turnRunning = false;
+
+  // what the sweep still owes, one stroke at a time so a double feed is
+  // known before the next card: it pays off that seat's next card, and the
+  // seat only takes what it's owed after whatever it got extra
+  for (int i = 0; i < players && !emergencyStop; i++)
+  {
+    while (missed[i] > extra[i] && !emergencyStop)
+    {
+      int got = dealCardsToPosition(360.0f / players * i, 1);
+      if (got == 0) break;  // tray empty, or it kept slipping
+      missed[i]--;
+      extra[i] += got - 1;
+    }
+  }
 }
 
-// ---------------------- dispense one card
-const double DEG_PER_CARD = 240.0;    // max degrees of rotation per card
-const int    MAX_MS = 240;            // max time for motor to run
-void dispenseOneCard()
-{
-  double startDispense = MotorDispense.position(deg);
-  MotorDispense.setVelocity(90, percent);
-  MotorDispense.spin(forward);
-
-  timer t;
-  while ((MotorDispense.position(deg) - startDispense) < DEG_PER_CARD
-         && t.time(msec) < MAX_MS) 
-  {}
-
-  MotorDispense.stop(brake);
-
-  int dispenseTime = t.time(msec);  // how long the motor ran fro
+// ---------------------- shuffle algorithm helpers ----------------------
 
-  MotorDispense.setVelocity(90, percent);  // same speed as forward
-  MotorDispense.spin(reverse);             // spin backwards
-
-  wait(dispenseTime + 200, msec);  // run backwards for the same time + extra
+// Fisher-Yates shuffle algorithm
+void shuffleArray(int arr[], int size)
+{
+  for (int i = size - 1; i > 0; i--)
+  {
+    int j = rand() % (i + 1);
+    // Swap arr[i] and arr[j]
+    int temp = arr[i];
+    arr[i] = arr[j];
+    arr[j] = temp;
+  }
+}
 
-  MotorDispense.stop(brake);
+// degrees the robot turns going from one seat to another
+float seatTurn(int fromSeat, int toSeat, int numSeats)
+{
+  return fabsf(convertAngle(360.0f / numSeats * (toSeat - fromSeat)));
 }
 
-// deal a set number of cards to a specific position, using rotation function 
-// + dispensing function()
-void dealCardsToPosition(double heading, int numCards) 
+// total degrees turned dealing order[] starting from startSeat
+float planRotation(const int order[], int totalCards, int startSeat, int numSeats)
 {
-  rotateToHeadingPID(heading);
-  for (int i = 0; i < numCards; i++) 
+  float total = 0.0f;
+  int seat = startSeat;
+  for (int i = 0; i < totalCards; i++)
   {
-    dispenseOneCard();
-    wait(80, msec);
+    total += seatTurn(seat, order[i], numSeats);
+    seat = order[i];
   }
+  return total;
 }
 
-bool allDealt(int seats[],int numplayers, int req) 
+// how far (in cards) the planner may move a card from its shuffled spot to
+// save turning. 0 keeps the plain Fisher-Yates order
+const int SHUFFLE_REORDER_WINDOW = 3;
+
+/*
+builds the order seats get their cards in. every card slot gets shuffled with
+Fisher-Yates first, so every seat order is equally likely. then, walking the
+order, the next card goes to the closest seat among the next window+1 cards
+still waiting, which cuts turning but keeps each card within window places of
+where the shuffle put it
+*/
+void planShuffle(int order[], int numSeats, int cardsPerSeat, int startSeat,
+                 int window)
 {
-  for (int i = 0; i < numplayers; i ++) 
+  int totalCards = numSeats * cardsPerSeat;
+  for (int i = 0; i < totalCards; i++)
   {
-    if (seats[i] != req) return false;
+    order[i] = i / cardsPerSeat;  // which seat this card goes to
   }
+  shuffleArray(order, totalCards);
 
-  return true;
-}
+  // where each card was in the shuffled order
+  int origin[52];
+  for (int i = 0; i < totalCards; i++)
+  {
+    origin[i] = i;
+  }
+
+  int seat = startSeat;
+  for (int i = 0; i < totalCards; i++)
+  {
+    // closest seat within the window, first one wins ties. cards that were
+    // skipped window times already have to go now
+    int best = i;
+    for (int j = i + 1; j <= i + window && j < totalCards
+                        && i - origin[i] < window; j++)
+    {
+      if (seatTurn(seat, order[j], numSeats) < seatTurn(seat, order[best], numSeats))
+      {
+        best = j;
+      }
+    }
 
+    // slide it forward, keeping the rest of the shuffled order
+    int picked = order[best];
+    int pickedOrigin = origin[best];
+    for (int j = best; j > i; j--)
+    {
+      order[j] = order[j - 1];
+      origin[j] = origin[j - 1];
+    }
+    order[i] = picked;
+    origin[i] = pickedOrigin;
+    seat = picked;
+  }
+}
 
 // ---------------------- random shuffling algorithm ----------------------
 void shuffleDeal(int numSeats, int totalCardsPerSeat) 
 {
+  const int maxCards = 52;
+  int totalCards = numSeats * totalCardsPerSeat;
+  int order[maxCards];
+  int shuffled[maxCards];
+
   // tracks how many cards each seat has received
   int cardsDealt[numSeats];
 
@@ -187,16 +1879,53 @@ void shuffleDeal(int numSeats, int totalCardsPerSeat)
     cardsDealt[i] = 0;
   }
 
-  while (!allDealt(cardsDealt,numSeats,totalCardsPerSeat)) 
+  // start from whichever seat the robot is facing
+  int startSeat = (int)((float)BrainInertial.heading(degrees) / (360.0f / numSeats) + 0.5f)
+                  % numSeats;
+
+  // same shuffle with and without reordering, to show what it saves
+  int seed = rand();
+  srand(seed);
+  planShuffle(shuffled, numSeats, totalCardsPerSeat, startSeat, 0);
+  srand(seed);
+  planShuffle(order, numSeats, totalCardsPerSeat, startSeat, SHUFFLE_REORDER_WINDOW);
+
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("turning %d deg", (int)planRotation(order, totalCards, startSeat, numSeats));
+  Brain.Screen.newLine();
+  Brain.Screen.print("unplanned %d deg", (int)planRotation(shuffled, totalCards, startSeat, numSeats));
+  wait(1, seconds);
+
+  int index = 0;
+  while (index < totalCards && !emergencyStop) 
   {
-    int index = rand() % numSeats;
+    int seat = order[index];
+    if (seat < 0) // taken out after a double feed
+    {
+      index++;
+      continue;
+    }
+
+    // consecutive cards to the same seat are dealt in one visit
+    int burst = 1;
+    while (index + burst < totalCards && order[index + burst] == seat)
+    {
+      burst++;
+    }
 
-    int pileSize = cardsDealt[index];
+    int dealt = dealCardsToPosition(360.0f/numSeats*seat, burst);
+    cardsDealt[seat] += dealt;
+    index += burst;
 
-    if (pileSize!=totalCardsPerSeat) 
+    // a double feed gave this seat a later card early, take it out of the order
+    for (int i = index; i < totalCards && dealt > burst; i++)
     {
-      dealCardsToPosition(360.0/numSeats*index,1);
-      cardsDealt[index] ++;
+      if (order[i] == seat)
+      {
+        order[i] = -1;
+        dealt--;
+      }
     }
 
     Brain.Screen.clearScreen();
@@ -208,11 +1937,96 @@ void shuffleDeal(int numSeats, int totalCardsPerSeat)
   }
 }
 
+// ---------------------- input events
+// buttons and the touchled push events from their pressed/released callbacks
+// into a small queue. menus block on waitForButton(), which sleeps between
+// checks instead of spinning on pressing(), so other threads get the cpu.
+const int BUTTON_LEFT  = 0;
+const int BUTTON_RIGHT = 1;
+const int BUTTON_CHECK = 2;
+const int BUTTON_TOUCH = 3;   // the touchled
+
+const int DEBOUNCE_MS = 50;   // presses closer together than this are bounce
+const int EVENT_QUEUE_SIZE = 8;
+
+volatile int eventQueue[EVENT_QUEUE_SIZE];
+volatile int eventHead = 0;   // next event to read
+volatile int eventTail = 0;   // next free slot
+volatile bool buttonHeld[4] = {false, false, false, false};
+volatile uint32_t lastPressTime[4] = {0, 0, 0, 0};
+
+// called from the callbacks, one event per press
+void pushButtonEvent(int button)
+{
+  uint32_t now = timer::system();
+  if (buttonHeld[button] || now - lastPressTime[button] < DEBOUNCE_MS) return;
+  buttonHeld[button] = true;
+  lastPressTime[button] = now;
+
+  int next = (eventTail + 1) % EVENT_QUEUE_SIZE;
+  if (next == eventHead) return; // full, drop it
+  eventQueue[eventTail] = button;
+  eventTail = next;
+}
+
+void onLeftPressed()   { pushButtonEvent(BUTTON_LEFT); }
+void onRightPressed()  { pushButtonEvent(BUTTON_RIGHT); }
+void onCheckPressed()  { pushButtonEvent(BUTTON_CHECK); }
+void onTouchPressed()
+{
+  if (emergencyStopArmed()) triggerEmergencyStop();
+  else pushButtonEvent(BUTTON_TOUCH);
+}
+void onLeftReleased()  { buttonHeld[BUTTON_LEFT] = false; }
+void onRightReleased() { buttonHeld[BUTTON_RIGHT] = false; }
+void onCheckReleased() { buttonHeld[BUTTON_CHECK] = false; }
+void onTouchReleased() { buttonHeld[BUTTON_TOUCH] = false; }
+
+void setupInput()
+{
+  Brain.buttonLeft.pressed(onLeftPressed);
+  Brain.buttonLeft.released(onLeftReleased);
+  Brain.buttonRight.pressed(onRightPressed);
+  Brain.buttonRight.released(onRightReleased);
+  Brain.buttonCheck.pressed(onCheckPressed);
+  Brain.buttonCheck.released(onCheckReleased);
+  TouchLED.pressed(onTouchPressed);
+  TouchLED.released(onTouchReleased);
+}
+
+// forget presses made before this screen was shown
+void clearInput()
+{
+  eventHead = eventTail;
+}
+
+// sleeps until the next button press and returns which button it was
+int waitForButton()
+{
+  waitingForInput = true;
+  while (eventHead == eventTail)
+  {
+    wait(10, msec);
+  }
+  waitingForInput = false;
+  int button = eventQueue[eventHead];
+  eventHead = (eventHead + 1) % EVENT_QUEUE_SIZE;
+  return button;
+}
+
+void waitForCheck()
+{
+  while (waitForButton() != BUTTON_CHECK)
+  {}
+}
+
 // mode constants
 const int MODE_DEAL = 0;
 const int MODE_SHUFFLE = 1;
 const int MODE_SORT = 2;
-const int MODE_EXIT = 3;
+const int MODE_TUNE = 3;
+const int MODE_CALIBRATE = 4;
+const int MODE_EXIT = 5;
 
 /*
 method runs user interface for selecting which process to run
@@ -220,6 +2034,7 @@ returns an integer indicating mode (deal, shuffle, or sort)
 */
 
 int selectMode() {
+  clearInput();
   Brain.Screen.clearScreen();
   Brain.Screen.setCursor(1,1);
   
@@ -253,6 +2068,18 @@ int selectMode() {
       Brain.Screen.print(" ***");
     }
     Brain.Screen.newLine();
+    Brain.Screen.print("AUTOTUNE");
+    if (i == MODE_TUNE) 
+    {
+      Brain.Screen.print(" ***");
+    }
+    Brain.Screen.newLine();
+    Brain.Screen.print("COLOR CAL");
+    if (i == MODE_CALIBRATE) 
+    {
+      Brain.Screen.print(" ***");
+    }
+    Brain.Screen.newLine();
     Brain.Screen.print("EXIT");
     if (i == MODE_EXIT) 
     {
@@ -261,41 +2088,32 @@ int selectMode() {
     Brain.Screen.newLine();
 
     // waits until any button is pressed
-    while(!Brain.buttonLeft.pressing() 
-          && !Brain.buttonRight.pressing() 
-          && !Brain.buttonCheck.pressing()) 
-    {}
+    int button = waitForButton();
 
     Brain.Screen.clearScreen();
 
-    // if the checkmark is pressed
-    if (Brain.buttonCheck.pressing()) 
+    // if the checkmark is pressed return selected mode
+    if (button == BUTTON_CHECK) 
     {
-      // wait until button released and return selected mode
-      while (Brain.buttonCheck.pressing()) {}
       return i;
     }
 
     // changes the current mode based on input
-    if (Brain.buttonLeft.pressing()) 
+    if (button == BUTTON_LEFT) 
     {
       i --; 
     } 
-    else if (Brain.buttonRight.pressing()) 
+    else if (button == BUTTON_RIGHT) 
     {
       i ++;
     }
 
-    // waits until buttons are no longer being pressed
-    while (Brain.buttonLeft.pressing() || Brain.buttonRight.pressing()) 
-    {}
-
     // overflow conditions
     if (i == -1) 
     {
       i = MODE_EXIT;
     } 
-    else if (i==4) 
+    else if (i == MODE_EXIT + 1) 
     {
       i = MODE_DEAL;
     }
@@ -308,6 +2126,8 @@ taking part in the game. returns a number between 2 and max
 */ 
 int getNumPlayers(int max) 
 {
+  uint32_t shown = timer::system();
+  clearInput();
   Brain.Screen.clearScreen();
   Brain.Screen.setCursor(1,1);
   
@@ -328,41 +2148,33 @@ int getNumPlayers(int max)
     Brain.Screen.print("%d",i);
 
     // waits until any button is pressed
-    while(!Brain.buttonLeft.pressing() 
-          && !Brain.buttonRight.pressing() 
-          && !Brain.buttonCheck.pressing()) 
-    {}
+    int button = waitForButton();
 
     Brain.Screen.clearScreen();
 
-    // checks if the checkmark was pressed
-    if (Brain.buttonCheck.pressing()) 
+    // checks if the checkmark was pressed, returns # players
+    if (button == BUTTON_CHECK) 
     {
-        // waits until button is released and then returns # players
-      while (Brain.buttonCheck.pressing()) 
-      {}
+      recordPhase(PHASE_MENU, timer::system() - shown);
       return i;
     }
 
     // ensures # players selected stays within bounds
-    if (i > 2 && Brain.buttonLeft.pressing()) 
+    if (i > 2 && button == BUTTON_LEFT) 
     {
       i --; 
     } 
-    else if (i < max && Brain.buttonRight.pressing()) 
+    else if (i < max && button == BUTTON_RIGHT) 
     {
       i ++;
     }
-
-    // waits until buttons are released before proceeding
-    while (Brain.buttonLeft.pressing() || Brain.buttonRight.pressing()) 
-    {}
-
   }
 }
 
 int getCardsPer(int max) 
 {
+  uint32_t shown = timer::system();
+  clearInput();
   Brain.Screen.clearScreen();
   Brain.Screen.setCursor(1,1);
 
@@ -383,54 +2195,45 @@ int getCardsPer(int max)
     Brain.Screen.print("%d",i);
 
     // waits until any button is pressed
-    while(!Brain.buttonLeft.pressing()
-          && !Brain.buttonRight.pressing()
-          && !Brain.buttonCheck.pressing()) 
-    {}
+    int button = waitForButton();
 
     Brain.Screen.clearScreen();
 
-    // checks if the checkmark was pressed
-    if (Brain.buttonCheck.pressing()) 
+    // checks if the checkmark was pressed, returns # cards
+    if (button == BUTTON_CHECK) 
     {
-        // waits until button is released and then returns # cards
-      while (Brain.buttonCheck.pressing()) {}
+      recordPhase(PHASE_MENU, timer::system() - shown);
       return i;
     }
 
     // ensures # cards selected stays within bounds
-    if (i > 1 && Brain.buttonLeft.pressing()) 
+    if (i > 1 && button == BUTTON_LEFT) 
     {
       i --;
     } 
-    else if (i < max && Brain.buttonRight.pressing()) 
+    else if (i < max && button == BUTTON_RIGHT) 
     {
       i ++;
     }
-    else if (i <= 1 && Brain.buttonLeft.pressing())
+    else if (i <= 1 && button == BUTTON_LEFT)
     {
         i = max;
     }
-    else if (i > max && Brain.buttonRight.pressing())
+    else if (i > max && button == BUTTON_RIGHT)
     {
         i = 1;
     }
-
-    // waits until buttons are released before proceeding
-    while (Brain.buttonLeft.pressing() || Brain.buttonRight.pressing()) 
-    {}
-
   }
 }
 
 void dispenseIndividualCardsUI(int numplayers) {
-  double currentHeading = 0;
+  float currentHeading = 0;
 
   rotateToHeadingPID(currentHeading);
 
-  
+  clearInput();
   bool running = true;
-  while (running) {
+  while (running && !emergencyStop) {
     Brain.Screen.clearScreen();
     Brain.Screen.setCursor(1,1);
     Brain.Screen.print("<> to rotate");
@@ -442,35 +2245,27 @@ void dispenseIndividualCardsUI(int numplayers) {
 
     TouchLED.setColor(color::blue);
 
-    while (!Brain.buttonRight.pressing() &&
-           !Brain.buttonLeft.pressing() &&
-           !Brain.buttonCheck.pressing() &&
-           !TouchLED.pressing()) 
-    {}
+    int button = waitForButton();
     
-    if (TouchLED.pressing()) {
-      while (TouchLED.pressing()) {}
+    if (button == BUTTON_TOUCH) {
       running = false;
     }
-    else if (Brain.buttonRight.pressing()) 
+    else if (button == BUTTON_RIGHT) 
     { 
-      while (Brain.buttonRight.pressing()) {}
       Brain.Screen.clearScreen();
       Brain.Screen.setCursor(1,1);
       Brain.Screen.print("turning right");
-      rotateToHeadingPID(currentHeading+360.0/numplayers);
-      currentHeading += 360.0/numplayers;
-    } else if (Brain.buttonLeft.pressing()) 
+      rotateToHeadingPID(currentHeading+360.0f/numplayers);
+      currentHeading += 360.0f/numplayers;
+    } else if (button == BUTTON_LEFT) 
     {
-      while (Brain.buttonLeft.pressing()) {}
       Brain.Screen.clearScreen();
       Brain.Screen.setCursor(1,1);
       Brain.Screen.print("turning right");
-      rotateToHeadingPID(currentHeading-360.0/numplayers);
-      currentHeading -= 360.0/numplayers;
-    } else if (Brain.buttonCheck.pressing())
+      rotateToHeadingPID(currentHeading-360.0f/numplayers);
+      currentHeading -= 360.0f/numplayers;
+    } else if (button == BUTTON_CHECK)
     {
-      while (Brain.buttonCheck.pressing()) {}
       dispenseOneCard();
     }
   }
@@ -482,6 +2277,8 @@ void dispenseIndividualCardsUI(int numplayers) {
 // used for MODE_DEAL and MODE_SHUFFLE
 bool askContinue(int numplayers) 
 {
+  uint32_t shown = timer::system();
+	clearInput();
 	wait(1, seconds);
 	Brain.Screen.clearScreen();
 
@@ -518,147 +2315,719 @@ bool askContinue(int numplayers)
     }
 		Brain.Screen.newLine();
 
-		while(!Brain.buttonLeft.pressing()
-		      && !Brain.buttonRight.pressing()
-		      && !Brain.buttonCheck.pressing()) 
-    {}
+		int button = waitForButton();
+
+		Brain.Screen.clearScreen(); // reloads screen when button pressed
+
+        // if checkmark/user confirms
+		if (button == BUTTON_CHECK) 
+    {
+      if (selection != 2) {
+        recordPhase(PHASE_MENU, timer::system() - shown);
+        return (selection == 0); 
+      }
+      else {
+        // run dispense individual cards ui
+        dispenseIndividualCardsUI(numplayers);
+        if (emergencyStop) return false;
+      }
+      // if selection is 0 (yes), true - if not 0, false
+		}
+
+
+        // if other button is pressed, alter selection -> reload screen
+		if (button == BUTTON_LEFT) 
+    {
+			selection--;
+		} 
+    else if (button == BUTTON_RIGHT) 
+    {
+			selection++;
+		}
+
+		// overflow conditions (wrap around)
+		if (selection == -1) 
+    {
+			selection = 2;
+		} 
+    else if (selection == 3) 
+    {
+			selection = 0;
+		}
+        // end of while loop - if checkmark not pressed, goes back to top
+	}
+  return false;
+}
+
+// ---------------------- card color
+// one hue read can sit right on a threshold, or catch glare or the card
+// still sliding into place, so a card is read COLOR_SAMPLES times, one per
+// sensor update, and classed on the median hue, or on the median of each
+// feature once there's a color calibration (below). hue wraps at 360 (red
+// is both ends), so its median is taken around the circular mean.
+// confidence is the share of reads that class the same as the median. on
+// the hue ranges it's cut down when the brightness doesn't fit (a "card"
+// as dark as the empty tray, or the other way round) or the rgb is too grey
+// for the hue to mean anything. below COLOR_MIN_CONFIDENCE the card gets
+// re-read with more samples.
+const int   COLOR_SAMPLES = 5;
+const int   COLOR_REREAD_SAMPLES = 9;   // also the most readCard() takes
+const int   COLOR_REREADS = 2;
+const int   COLOR_SAMPLE_MS = 10;       // optical sensor update period
+const float COLOR_MIN_CONFIDENCE = 0.8f;
+const float CARD_BRIGHTNESS = 40.0f;    // cards read brighter than the tray
+const float COLOR_MIN_CHROMA = 0.15f;   // (max - min) / max of the rgb
+const float DEG_TO_RAD = 0.01745329f;
+
+const int COLOR_EMPTY = 4;    // cyan tray showing, no cards
+const int COLOR_UNKNOWN = 5;
+constexpr float REJECT_HEADING = 45.0f;  // unknown colors, between piles 0 and 1
+
+int colorRereads = 0;         // re-reads since boot, for colorSort's summary
+
+struct CardReading
+{
+  int   color;        // 0-3 suit, COLOR_EMPTY, COLOR_UNKNOWN
+  float confidence;   // 0..1
+  float hue;          // median hue (deg)
+  float brightness;   // median brightness (%)
+  float heading;      // pile this card goes to
+};
+
+// fixed hue ranges for each class and the pile it's sorted to, from
+// colors.txt. they're turned into HUE_TABLE, one class and heading per
+// degree, when the firmware is compiled, so sorting a card by hue is a
+// single read. edit the ranges (whole degrees), not the table.
+struct HueRange
+{
+  float from;     // deg, inclusive
+  float to;       // deg, exclusive
+  int   color;
+  float heading;  // pile
+};
+
+constexpr HueRange HUE_RANGES[] = {
+  {  0.0f,  20.0f, 0,             0.0f},  // hearts red
+  { 20.0f,  45.0f, 1,            90.0f},  // spades orange/ brown
+  {215.0f, 360.0f, 2,           180.0f},  // diamonds blue purple pink
+  { 45.0f, 151.0f, 3,           270.0f},  // clubs yellow and green
+  {180.0f, 205.0f, COLOR_EMPTY,   0.0f},  // if cyan is seen, never turns
+};
+const int NUM_HUE_RANGES = sizeof(HUE_RANGES) / sizeof(HUE_RANGES[0]);
+const int HUE_BINS = 360;
+
+// first range the hue is in, COLOR_UNKNOWN if none (incase something weird
+// happens). c++11 constexpr, so one return
+constexpr int rangeClass(float hue, int i = 0)
+{
+  return i >= NUM_HUE_RANGES ? COLOR_UNKNOWN
+       : (hue >= HUE_RANGES[i].from && hue < HUE_RANGES[i].to) ? HUE_RANGES[i].color
+       : rangeClass(hue, i + 1);
+}
+
+constexpr float rangeHeading(float hue, int i = 0)
+{
+  return i >= NUM_HUE_RANGES ? REJECT_HEADING
+       : (hue >= HUE_RANGES[i].from && hue < HUE_RANGES[i].to) ? HUE_RANGES[i].heading
+       : rangeHeading(hue, i + 1);
+}
+
+// 0, 1, ... HUE_BINS - 1 as a template pack, to expand the table from
+template <int... I> struct HueBins {};
+template <int N, int... I> struct MakeHueBins : MakeHueBins<N - 1, N - 1, I...> {};
+template <int... I> struct MakeHueBins<0, I...> { typedef HueBins<I...> type; };
+
+struct HueBin
+{
+  uint8_t color;
+  float   heading;
+};
+
+struct HueTable
+{
+  HueBin bin[HUE_BINS];
+};
+
+template <int... I>
+constexpr HueTable makeHueTable(HueBins<I...>)
+{
+  return HueTable{{HueBin{(uint8_t)rangeClass((float)I), rangeHeading((float)I)}...}};
+}
+
+constexpr HueTable HUE_TABLE = makeHueTable(MakeHueBins<HUE_BINS>::type());
+
+// a bin agrees with the ranges if its first and last hue get its class
+constexpr bool binMatches(int d)
+{
+  return d < 0 || d >= HUE_BINS
+      || (HUE_TABLE.bin[d].color == rangeClass((float)d)
+          && HUE_TABLE.bin[d].color == rangeClass((float)d + 0.999f)
+          && HUE_TABLE.bin[d].heading == rangeHeading((float)d + 0.999f));
+}
+
+// every range starts and ends on a whole degree, and the bins both sides
+// of each end match it
+constexpr bool rangesMatch(int i = 0)
+{
+  return i >= NUM_HUE_RANGES
+      || (HUE_RANGES[i].from == (float)(int)HUE_RANGES[i].from
+          && HUE_RANGES[i].to == (float)(int)HUE_RANGES[i].to
+          && HUE_RANGES[i].from >= 0.0f && HUE_RANGES[i].from < HUE_RANGES[i].to
+          && HUE_RANGES[i].to <= (float)HUE_BINS
+          && binMatches((int)HUE_RANGES[i].from - 1) && binMatches((int)HUE_RANGES[i].from)
+          && binMatches((int)HUE_RANGES[i].to - 1) && binMatches((int)HUE_RANGES[i].to)
+          && rangesMatch(i + 1));
+}
+static_assert(rangesMatch(), "hue table doesn't match the ranges");
+
+// the table and the heading of each color class for the pile layout in use
+// (see pile layout). the empty tray ends the sort, never turns
+HueTable hueTable = HUE_TABLE;
+float pileHeading[COLOR_UNKNOWN + 1] = {0.0f, 90.0f, 180.0f, 270.0f, 0.0f, REJECT_HEADING};
+
+const HueBin &hueBin(float hue)
+{
+  static const HueBin unknown = {COLOR_UNKNOWN, REJECT_HEADING};
+  if (!(hue >= 0.0f && hue < (float)HUE_BINS)) return unknown;
+  return hueTable.bin[(int)hue];
+}
+
+int hueClass(float hue)
+{
+  return hueBin(hue).color;
+}
+
+// sorts a few floats in place
+void sortSamples(float *v, int n)
+{
+  for (int i = 1; i < n; i++)
+  {
+    float x = v[i];
+    int j = i - 1;
+    while (j >= 0 && v[j] > x)
+    {
+      v[j + 1] = v[j];
+      j--;
+    }
+    v[j + 1] = x;
+  }
+}
+
+// ---------------------- color calibration
+// the hue ranges were picked by eye (colors.txt) under one room's light and
+// drift with it. calibrateColors() deals each suit past the sensor and
+// keeps the mean of its samples, one centroid per suit plus the empty tray,
+// in r/g/b shares (so overall light level drops out) and brightness. with a
+// calibration loaded, cards are classed by the nearest centroid instead of
+// the hue ranges. the file is five lines of "r g b brightness spread" in
+// class order, spread being the rms distance of the class's samples from
+// its centroid. the samples themselves go to COLOR_SAMPLE_FILE, which
+// sim/colorcheck turns into an accuracy report.
+const char *const COLOR_CAL_FILE = "cardcolors.txt";
+const char *const COLOR_SAMPLE_FILE = "cardsamples.csv";
+const int   COLOR_CLASSES = 5;          // 4 suits + empty tray
+const int   COLOR_FEATURES = 4;
+const float COLOR_MAX_SPREADS = 5.0f;   // further than this from every
+                                        // centroid (in spreads) = unknown
+const float COLOR_MIN_SPREAD = 0.02f;   // so a tight class isn't too strict
+
+bool  colorCalibrated = false;
+float colorCentroid[COLOR_CLASSES][COLOR_FEATURES];
+float colorSpread[COLOR_CLASSES];
+
+struct ColorSample
+{
+  float hue;
+  float red;
+  float green;
+  float blue;
+  float brightness;
+};
+
+// n reads, one per sensor update
+void sampleColor(ColorSample *samples, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    if (i > 0) wait(COLOR_SAMPLE_MS, msec);
+    samples[i].hue = (float)OpticalSensor.hue();
+    optical::rgbc c = OpticalSensor.getRgb();
+    samples[i].red = (float)c.red;
+    samples[i].green = (float)c.green;
+    samples[i].blue = (float)c.blue;
+    samples[i].brightness = (float)c.brightness;
+  }
+}
+
+void colorFeatures(const ColorSample &s, float *f)
+{
+  float sum = s.red + s.green + s.blue;
+  if (sum <= 0.0f) sum = 1.0f;
+  f[0] = s.red / sum;
+  f[1] = s.green / sum;
+  f[2] = s.blue / sum;
+  f[3] = s.brightness / 100.0f;
+}
+
+float colorDistance(const float *f, int c)
+{
+  float d = 0.0f;
+  for (int k = 0; k < COLOR_FEATURES; k++)
+  {
+    float e = f[k] - colorCentroid[c][k];
+    d += e * e;
+  }
+  return sqrtf(d);
+}
+
+// nearest centroid, or COLOR_UNKNOWN when it's far from all of them
+int nearestColor(const float *f)
+{
+  int best = 0;
+  float bestD = colorDistance(f, 0);
+  for (int c = 1; c < COLOR_CLASSES; c++)
+  {
+    float d = colorDistance(f, c);
+    if (d < bestD)
+    {
+      best = c;
+      bestD = d;
+    }
+  }
+  if (bestD > COLOR_MAX_SPREADS * fmaxf(colorSpread[best], COLOR_MIN_SPREAD)) return COLOR_UNKNOWN;
+  return best;
+}
+
+bool loadColorCalibration()
+{
+  if (!Brain.SDcard.isInserted() || !Brain.SDcard.exists(COLOR_CAL_FILE)) return false;
+
+  char text[256];
+  int32_t n = Brain.SDcard.loadfile(COLOR_CAL_FILE, (uint8_t *)text, sizeof(text) - 1);
+  if (n <= 0) return false;
+  text[n] = 0;
+
+  float centroid[COLOR_CLASSES][COLOR_FEATURES];
+  float spread[COLOR_CLASSES];
+  const char *at = text;
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    int used = 0;
+    if (sscanf(at, "%f %f %f %f %f%n", &centroid[c][0], &centroid[c][1],
+               &centroid[c][2], &centroid[c][3], &spread[c], &used) != 5) return false;
+    at += used;
+  }
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    for (int k = 0; k < COLOR_FEATURES; k++) colorCentroid[c][k] = centroid[c][k];
+    colorSpread[c] = spread[c];
+  }
+  colorCalibrated = true;
+  return true;
+}
+
+bool saveColorCalibration()
+{
+  if (!Brain.SDcard.isInserted()) return false;
+  char text[256];
+  int n = 0;
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    n += snprintf(text + n, sizeof(text) - n, "%.4f %.4f %.4f %.4f %.4f\n",
+                  (double)colorCentroid[c][0], (double)colorCentroid[c][1],
+                  (double)colorCentroid[c][2], (double)colorCentroid[c][3],
+                  (double)colorSpread[c]);
+  }
+  return Brain.SDcard.savefile(COLOR_CAL_FILE, (uint8_t *)text, n) == n;
+}
+
+// hue around the circular mean, so red reads either side of 0 don't
+// average out to cyan
+float medianHue(const ColorSample *samples, int n)
+{
+  float x = 0.0f, y = 0.0f;
+  for (int i = 0; i < n; i++)
+  {
+    x += cosf(samples[i].hue * DEG_TO_RAD);
+    y += sinf(samples[i].hue * DEG_TO_RAD);
+  }
+  float mean = atan2f(y, x) / DEG_TO_RAD;
+  float offsets[COLOR_REREAD_SAMPLES];
+  for (int i = 0; i < n; i++)
+  {
+    offsets[i] = samples[i].hue - mean;
+    while (offsets[i] > 180.0f) offsets[i] -= 360.0f;
+    while (offsets[i] < -180.0f) offsets[i] += 360.0f;
+  }
+  sortSamples(offsets, n);
+
+  float hue = mean + offsets[n / 2];
+  while (hue >= 360.0f) hue -= 360.0f;
+  while (hue < 0.0f) hue += 360.0f;
+  return hue;
+}
+
+CardReading readCard(int samples = COLOR_SAMPLES)
+{
+  if (samples > COLOR_REREAD_SAMPLES) samples = COLOR_REREAD_SAMPLES;
+  ColorSample s[COLOR_REREAD_SAMPLES];
+  sampleColor(s, samples);
+
+  CardReading card;
+  float column[COLOR_REREAD_SAMPLES];
+  for (int i = 0; i < samples; i++) column[i] = s[i].brightness;
+  sortSamples(column, samples);
+  card.brightness = column[samples / 2];
+  card.hue = medianHue(s, samples);
+
+  int classes[COLOR_REREAD_SAMPLES];
+  if (colorCalibrated)
+  {
+    // nearest centroid to the median of each feature
+    float f[COLOR_REREAD_SAMPLES][COLOR_FEATURES];
+    float mid[COLOR_FEATURES];
+    for (int i = 0; i < samples; i++)
+    {
+      colorFeatures(s[i], f[i]);
+      classes[i] = nearestColor(f[i]);
+    }
+    for (int k = 0; k < COLOR_FEATURES; k++)
+    {
+      for (int i = 0; i < samples; i++) column[i] = f[i][k];
+      sortSamples(column, samples);
+      mid[k] = column[samples / 2];
+    }
+    card.color = nearestColor(mid);
+    card.heading = pileHeading[card.color];
+  }
+  else
+  {
+    for (int i = 0; i < samples; i++) classes[i] = hueClass(s[i].hue);
+    const HueBin &bin = hueBin(card.hue);
+    card.color = bin.color;
+    card.heading = bin.heading;
+  }
+
+  int agree = 0;
+  for (int i = 0; i < samples; i++)
+  {
+    if (classes[i] == card.color) agree++;
+  }
+  card.confidence = (float)agree / samples;
+  if (colorCalibrated) return card;  // brightness and rgb are in the centroids
+
+  bool dark = card.brightness < CARD_BRIGHTNESS;
+  if (card.color <= 3 ? dark : (card.color == COLOR_EMPTY && !dark))
+  {
+    card.confidence *= 0.5f;
+  }
+  float red = 0.0f, green = 0.0f, blue = 0.0f;
+  for (int i = 0; i < samples; i++)
+  {
+    red += s[i].red;
+    green += s[i].green;
+    blue += s[i].blue;
+  }
+  float most = fmaxf(red, fmaxf(green, blue));
+  float chroma = most > 0.0f ? (most - fminf(red, fminf(green, blue))) / most : 0.0f;
+  if (card.color != COLOR_EMPTY && chroma < COLOR_MIN_CHROMA)
+  {
+    card.confidence *= chroma / COLOR_MIN_CHROMA;
+  }
+  return card;
+}
+
+// reads the card again with more samples while it's unsure, keeps the
+// most confident reading. the retract drags the next card back into place,
+// so it's read once that's over, standing still like calibrateColors() saw it
+CardReading readCardSure()
+{
+  waitForRetract();
+  CardReading card = readCard();
+  for (int i = 0; i < COLOR_REREADS && card.confidence < COLOR_MIN_CONFIDENCE; i++)
+  {
+    colorRereads++;
+    CardReading again = readCard(COLOR_REREAD_SAMPLES);
+    if (again.confidence > card.confidence) card = again;
+  }
+  return card;
+}
+
+// get current color of card in tray
+int getCardColor()
+{
+  return readCardSure().color;
+}
 
-		Brain.Screen.clearScreen(); // reloads screen when button pressed
+// calibration mode: the user loads one suit at a time, any number of cards.
+// each card is read, then dealt straight ahead, and its samples only count
+// once the stroke saw it go out. two strokes in a row with nothing out
+// means that suit is done. the empty tray is read last.
+const char *const COLOR_NAMES[COLOR_CLASSES] = {"hearts", "spades", "diamonds", "clubs", "tray"};
 
-        // if checkmark/user confirms
-		if (Brain.buttonCheck.pressing()) 
+void calibrateColors()
+{
+  float sum[COLOR_CLASSES][COLOR_FEATURES];
+  float sumSq[COLOR_CLASSES];   // of |features|^2, for the spread
+  int count[COLOR_CLASSES];
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    for (int k = 0; k < COLOR_FEATURES; k++) sum[c][k] = 0.0f;
+    sumSq[c] = 0.0f;
+    count[c] = 0;
+  }
+
+  const char *header = "card,class,red,green,blue,brightness,hue\n";
+  bool recording = Brain.SDcard.isInserted()
+                   && Brain.SDcard.savefile(COLOR_SAMPLE_FILE, (uint8_t *)header,
+                                            (int32_t)strlen(header)) == (int32_t)strlen(header);
+  int cards = 0;
+
+  for (int c = 0; c < COLOR_CLASSES && !emergencyStop; c++)
+  {
+    Brain.Screen.clearScreen();
+    Brain.Screen.setCursor(1,1);
+    if (c < 4) Brain.Screen.print("load only %s", COLOR_NAMES[c]);
+    else Brain.Screen.print("empty the tray");
+    Brain.Screen.newLine();
+    Brain.Screen.print("press check");
+    clearInput();
+    waitForCheck();
+
+    int nothing = 0;
+    while (!emergencyStop)
     {
-			while (Brain.buttonCheck.pressing()) 
-      {}
-      if (selection != 2) {
-        return (selection == 0); 
+      waitForRetract();  // card sits still again
+      ColorSample samples[COLOR_REREAD_SAMPLES];
+      sampleColor(samples, COLOR_REREAD_SAMPLES);
+      if (c < 4)
+      {
+        dispenseOneCard();
+        if (strokeCardsSeen == 0)
+        {
+          if (++nothing >= 2) break;
+          continue;
+        }
+        nothing = 0;
       }
-      else {
-        // run dispense individual cards ui
-        dispenseIndividualCardsUI(numplayers);
+
+      char text[COLOR_REREAD_SAMPLES * 48];
+      int n = 0;
+      for (int i = 0; i < COLOR_REREAD_SAMPLES; i++)
+      {
+        float f[COLOR_FEATURES];
+        colorFeatures(samples[i], f);
+        for (int k = 0; k < COLOR_FEATURES; k++)
+        {
+          sum[c][k] += f[k];
+          sumSq[c] += f[k] * f[k];
+        }
+        count[c]++;
+        n += snprintf(text + n, sizeof(text) - n, "%d,%d,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                      cards, c, (double)samples[i].red, (double)samples[i].green,
+                      (double)samples[i].blue, (double)samples[i].brightness,
+                      (double)samples[i].hue);
       }
-      // if selection is 0 (yes), true - if not 0, false
-		}
+      if (recording) Brain.SDcard.appendfile(COLOR_SAMPLE_FILE, (uint8_t *)text, n);
+      cards++;
+      if (c == COLOR_EMPTY) break;
+    }
+  }
+  if (emergencyStop) return;
 
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    if (count[c] > 0) continue;
+    Brain.Screen.print("no %s read, not saved", COLOR_NAMES[c]);
+    return;
+  }
 
-        // if other button is pressed, alter selection -> reload screen
-		if (Brain.buttonLeft.pressing()) 
-    {
-			selection--;
-		} 
-    else if (Brain.buttonRight.pressing()) 
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    float meanSq = 0.0f;
+    for (int k = 0; k < COLOR_FEATURES; k++)
     {
-			selection++;
-		}
-		while (Brain.buttonLeft.pressing() || Brain.buttonRight.pressing()) 
-    {}
+      colorCentroid[c][k] = sum[c][k] / count[c];
+      meanSq += colorCentroid[c][k] * colorCentroid[c][k];
+    }
+    colorSpread[c] = sqrtf(fmaxf(sumSq[c] / count[c] - meanSq, 0.0f));
+  }
+  colorCalibrated = true;
 
-		// overflow conditions (wrap around)
-		if (selection == -1) 
-    {
-			selection = 2;
-		} 
-    else if (selection == 3) 
-    {
-			selection = 0;
-		}
-        // end of while loop - if checkmark not pressed, goes back to top
-	}
-  return false;
+  Brain.Screen.print("%d cards, %s", cards - 1,
+                     saveColorCalibration() ? "saved" : "not saved");
+  for (int c = 0; c < COLOR_CLASSES; c++)
+  {
+    Brain.Screen.newLine();
+    Brain.Screen.print("%s %d spread %.3f", COLOR_NAMES[c], count[c] / COLOR_REREAD_SAMPLES,
+                       (double)colorSpread[c]);
+  }
 }
 
-// get current color of card in tray
-int getCardColor() 
+// ---------------------- pile layout
+// each card turns from the last card's pile to its own, so which suit goes
+// at which heading matters when the deck isn't well shuffled (a deck picked
+// up after a game comes in runs). every sort counts suit-to-suit moves into
+// SUIT_MOVES_FILE, and the next sort puts the suits at whichever of the 24
+// layouts turns least on those counts. the layout is shown before the sort
+// so the piles can be set out to match.
+const char *const SUIT_MOVES_FILE = "suitmoves.txt";
+const int   NUM_SUITS = 4;
+const float PILE_SPOTS[NUM_SUITS] = {0.0f, 90.0f, 180.0f, 270.0f};
+
+int suitMoves[NUM_SUITS][NUM_SUITS];  // [from][to], across every sort since
+                                      // boot, or since the file if there is one
+
+// replaces the counts in ram only with a file that reads back whole, so
+// without an sd card they keep adding up from sort to sort
+bool loadSuitMoves()
 {
-  double hue = OpticalSensor.hue();
-  // hearts red
-  if (hue >= 0 && hue < 20) 
-  {
-    return 0;
-  }
+  if (!Brain.SDcard.isInserted() || !Brain.SDcard.exists(SUIT_MOVES_FILE)) return false;
 
-  // spades orange/ brown
-  else if (hue >= 20 && hue < 45) 
+  char text[256];
+  int32_t n = Brain.SDcard.loadfile(SUIT_MOVES_FILE, (uint8_t *)text, sizeof(text) - 1);
+  if (n <= 0) return false;
+  text[n] = 0;
+
+  int moves[NUM_SUITS][NUM_SUITS];
+  const char *at = text;
+  for (int a = 0; a < NUM_SUITS; a++)
   {
-    return 1;
+    int used = 0;
+    if (sscanf(at, "%d %d %d %d%n", &moves[a][0], &moves[a][1], &moves[a][2],
+               &moves[a][3], &used) != 4) return false;
+    at += used;
   }
+  for (int a = 0; a < NUM_SUITS; a++)
+    for (int b = 0; b < NUM_SUITS; b++) suitMoves[a][b] = moves[a][b];
+  return true;
+}
 
-  // diamonds blue purple pink
-  else if (hue >= 215 && hue < 360) 
+bool saveSuitMoves()
+{
+  if (!Brain.SDcard.isInserted()) return false;
+  char text[256];
+  int n = 0;
+  for (int a = 0; a < NUM_SUITS; a++)
   {
-    return 2;
+    n += snprintf(text + n, sizeof(text) - n, "%d %d %d %d\n", suitMoves[a][0],
+                  suitMoves[a][1], suitMoves[a][2], suitMoves[a][3]);
   }
+  return Brain.SDcard.savefile(SUIT_MOVES_FILE, (uint8_t *)text, n) == n;
+}
 
-  // clubs yellow and green
-  else if (hue >= 45 && hue <= 150)
+// mean turn per move, deg, with suit s at PILE_SPOTS[spot[s]]
+float layoutTurn(const int *spot)
+{
+  float turn = 0.0f;
+  int moves = 0;
+  for (int a = 0; a < NUM_SUITS; a++)
   {
-    return 3;
+    for (int b = 0; b < NUM_SUITS; b++)
+    {
+      turn += suitMoves[a][b] * fabsf(convertAngle(PILE_SPOTS[spot[b]] - PILE_SPOTS[spot[a]]));
+      moves += suitMoves[a][b];
+    }
   }
+  return moves > 0 ? turn / moves : 0.0f;
+}
 
-  // if cyan is seen
-  else if (hue >= 180 && hue < 205)
+// tries every layout; ties keep the fixed one (hearts 0, spades 90, ...)
+// so the piles don't move around until the counts say so
+void planPileLayout(float &fixedTurn, float &bestTurn)
+{
+  int best[NUM_SUITS] = {0, 1, 2, 3};
+  fixedTurn = bestTurn = layoutTurn(best);
+  int spot[NUM_SUITS];
+  for (spot[0] = 0; spot[0] < NUM_SUITS; spot[0]++)
+    for (spot[1] = 0; spot[1] < NUM_SUITS; spot[1]++)
+      for (spot[2] = 0; spot[2] < NUM_SUITS; spot[2]++)
+      {
+        spot[3] = 6 - spot[0] - spot[1] - spot[2];
+        if (spot[0] == spot[1] || spot[0] == spot[2] || spot[1] == spot[2]) continue;
+        float turn = layoutTurn(spot);
+        if (turn < bestTurn - 0.5f)
+        {
+          bestTurn = turn;
+          for (int i = 0; i < NUM_SUITS; i++) best[i] = spot[i];
+        }
+      }
+  for (int i = 0; i < NUM_SUITS; i++) pileHeading[i] = PILE_SPOTS[best[i]];
+  for (int d = 0; d < HUE_BINS; d++)
   {
-    return 4;
+    if (hueTable.bin[d].color < NUM_SUITS) hueTable.bin[d].heading = pileHeading[hueTable.bin[d].color];
   }
+}
 
-  else 
+void showPileLayout(float fixedTurn, float bestTurn)
+{
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("turn %.0f deg/card (%.0f)", (double)bestTurn, (double)fixedTurn);
+  for (int i = 0; i < NUM_SUITS; i++)
   {
-    return 5; // incase something weird happens
+    Brain.Screen.newLine();
+    Brain.Screen.print("%s %.0f", COLOR_NAMES[i], (double)pileHeading[i]);
   }
+  Brain.Screen.newLine();
+  Brain.Screen.print("set piles, press check");
 }
 
 // sort cards into 4 suits
+
 void colorSort() 
 {
   const int piles = 6;
   // int cardsPerPile[4] = { 0, 0, 0, 0 };
   int cardsPerPile[piles] = {0, 0, 0, 0, 0,0};
 
+  loadSuitMoves();
+  float fixedTurn, bestTurn;
+  planPileLayout(fixedTurn, bestTurn);
+  showPileLayout(fixedTurn, bestTurn);
+  clearInput();
+  waitForCheck();
   Brain.Screen.clearScreen();
   Brain.Screen.setCursor(1, 1);
   Brain.Screen.print("Sorting cards by color");
 
   int colorPile = 0;
+  int lastSuit = -1;   // for suitMoves, reset by anything that isn't a suit
+  int rereadsBefore = colorRereads;
   // 4 is cyan
-  while (colorPile != 4)
+  while (colorPile != 4 && !emergencyStop)
   //for (int i = 0; i < 52; i++) 
   {
-    colorPile = getCardColor();
+    CardReading card = readCardSure();
+    colorPile = card.color;
 
-    if (colorPile == 0) // red
-    {
-      rotateToHeadingPID(0);
-      wait(200, msec);
-    }
-    else if (colorPile == 1) // blue
-    {
-      rotateToHeadingPID(90);
-      wait(200, msec);
-    }
-    else if (colorPile == 2) // green
-    {
-      rotateToHeadingPID(180);
-      wait(200, msec);
-    }
-    else if (colorPile == 3) // yellow
-    {
-      rotateToHeadingPID(270);
-      wait(200, msec);
-    } 
-    else if (colorPile == 5)
+    if (colorPile == COLOR_UNKNOWN)
     {
+      // still unsure after the re-reads, it goes on a pile of its own
       Brain.Screen.clearScreen();
       Brain.Screen.setCursor(1,1);
-      Brain.Screen.print("unrecognized color %f", OpticalSensor.hue());
-      wait(5000, msec);
-      
+      Brain.Screen.print("unrecognized color %.0f", (double)card.hue);
+    }
+    if (colorPile != COLOR_EMPTY)
+    {
+      rotateToHeadingPID(card.heading);
+      cardPause(200);
     }
 
     dispenseOneCard();
-    wait(100, msec);
+    cardPause(100);
 
     cardsPerPile[colorPile]++;
+    if (colorPile < NUM_SUITS)
+    {
+      if (lastSuit >= 0) suitMoves[lastSuit][colorPile]++;
+      lastSuit = colorPile;
+    }
+    else lastSuit = -1;
   }
+  saveSuitMoves();
 
   Brain.Screen.clearScreen();
   for (int i = 0; i < 4; i++) 
@@ -673,7 +3042,402 @@ void colorSort()
   Brain.Screen.print("cyan: %d", cardsPerPile[4]);
   Brain.Screen.setCursor(2, 1);
   Brain.Screen.print("NA: %d", cardsPerPile[5]);
+  Brain.Screen.setCursor(3, 1);
+  Brain.Screen.print("re-reads: %d", colorRereads - rereadsBefore);
+
+}
+
+// ---------------------- turn autotune
+// finds pid trim gains for rotateToHeadingPID in two steps:
+// 1. relay feedback: drive at +-RELAY_POWER, flipping whenever the robot
+//    crosses its start heading. the oscillation this settles into gives the
+//    ultimate gain ku and period tu, and pessen's "no overshoot" rule turns
+//    them into a starting kp/ki/kd.
+// 2. search: scale kp, ki and kd up and down one at a time, timing a set of
+//    turns the size we deal at (seats for 2-10 players, both directions),
+//    and keep whatever settles fastest. only the time after each turn's
+//    profile counts: the profile itself takes the same time whatever the
+//    gains. the gains we started with are in the running too, so tuning
+//    never makes things worse.
+const float RELAY_POWER = 25.0f;     // % power
+const float RELAY_HYSTERESIS = 0.5f; // deg either side of the start heading
+const int   RELAY_CYCLES = 6;        // periods measured, after 2 to settle in
+const int   RELAY_MAX_MS = 8000;
+
+// one seat for every player count from 2 to 10, each way
+const int   NUM_TUNE_TURNS = 18;
+const float tuneTurns[NUM_TUNE_TURNS] = {180, -180, 120, -120, 90, -90, 72, -72, 60, -60,
+                                         51.4f, -51.4f, 45, -45, 40, -40, 36, -36};
+const float TUNE_MISS_MS = 2000.0f;  // cost of a turn that misses tolerance
+const float TUNE_BETTER = 0.9f;      // must beat the best by 10%...
+const float TUNE_BETTER_MS = 10.0f;  // ...and 10 ms over the set, not just noise
+
+// ku in % power per degree, tu in seconds; false if it never oscillated
+bool relayExperiment(float &ku, float &tu)
+{
+  MotorLeft.setStopping(brake);
+  MotorRight.setStopping(brake);
+  MotorLeft.spin(forward);
+  MotorRight.spin(forward);
+  updateBatteryScale();
+
+  HeadingState h;
+  readHeadingState(h);
+  float center = h.angle;
+
+  LoopClock clock;
+  startLoop(clock, 10, 0);
+  timer t;
+
+  int dir = 1;             // +1 turning cw
+  int flips = 0;           // cw flips so far
+  float lastFlip = 0.0f;   // ms
+  float periodSum = 0.0f;
+  float high = -1000.0f, low = 1000.0f;
+
+  while (flips < RELAY_CYCLES + 2 && t.time(msec) < RELAY_MAX_MS && !emergencyStop)
+  {
+    float error = center - h.angle;
+    int want = dir;
+    if (error > RELAY_HYSTERESIS) want = 1;
+    else if (error < -RELAY_HYSTERESIS) want = -1;
+
+    if (want != dir)
+    {
+      dir = want;
+      if (dir == 1)
+      {
+        float now = (float)t.time(msec);
+        flips++;
+        if (flips > 2) periodSum += now - lastFlip; // first two are settling in
+        lastFlip = now;
+      }
+    }
+    if (flips >= 2)
+    {
+      if (error > high) high = error;
+      if (error < low) low = error;
+    }
+
+    // compensated like the turn loop so ku comes out in full battery %
+    MotorLeft.setVelocity( compensate(dir * RELAY_POWER), percent);
+    MotorRight.setVelocity(compensate(-dir * RELAY_POWER), percent);
+
+    waitForTick(clock);
+    readHeadingState(h);
+  }
+
+  MotorLeft.stop();
+  MotorRight.stop();
+
+  if (flips < RELAY_CYCLES + 2) return false;
+  float amplitude = (high - low) / 2.0f;
+  ku = 4.0f * RELAY_POWER / (3.14159f * amplitude);
+  tu = periodSum / RELAY_CYCLES / 1000.0f;
+  return true;
+}
+
+// ms the tune turns spend settling after their profiles with the current
+// gains, plus a penalty per miss
+float timeTuneTurns()
+{
+  float start = (float)BrainInertial.heading(degrees);
+  float cost = 0.0f;
+  for (int i = 0; i < NUM_TUNE_TURNS && !emergencyStop; i++)
+  {
+    start = start + tuneTurns[i];
+    bool ok = rotateToHeadingPID(start);
+    cost += (float)lastSettleMs;
+    if (!ok) cost += TUNE_MISS_MS;
+    wait(200, msec);  // let it come to rest between turns
+  }
+  return cost;
+}
+
+bool tuneBetter(float cost, float best)
+{
+  return cost < best * TUNE_BETTER && cost < best - TUNE_BETTER_MS;
+}
+
+// tries gain * scale for each gain in turn, keeps it if the turns settle faster
+void searchGains(float &best, float scale)
+{
+  float *gains[3] = {&turnKp, &turnKi, &turnKd};
+  const float defaults[3] = {DEFAULT_KP, DEFAULT_KI, DEFAULT_KD};
+  for (int g = 0; g < 3 && !emergencyStop; g++)
+  {
+    float original = *gains[g];
+    float tries[2] = {original * scale, original / scale};
+    if (original == 0.0f)
+    {
+      // scaling can't move it off zero, try the default instead
+      tries[0] = defaults[g];
+      tries[1] = defaults[g] / scale;
+    }
+    for (int k = 0; k < 2 && !emergencyStop; k++)
+    {
+      *gains[g] = tries[k];
+      float cost = timeTuneTurns();
+
+      Brain.Screen.clearScreen();
+      Brain.Screen.setCursor(1,1);
+      Brain.Screen.print("tuning %.3f %.3f %.3f", (double)turnKp, (double)turnKi, (double)turnKd);
+      Brain.Screen.newLine();
+      Brain.Screen.print("%d ms (best %d)", (int)cost, (int)best);
+
+      if (tuneBetter(cost, best))
+      {
+        best = cost;
+        original = tries[k];
+      }
+    }
+    *gains[g] = original;
+  }
+}
+
+void autotuneTurns()
+{
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("autotune: relay test");
+
+  float oldKp = turnKp, oldKi = turnKi, oldKd = turnKd;
+  float oldCost = timeTuneTurns();
+  float best = oldCost;
+
+  float ku, tu;
+  if (relayExperiment(ku, tu) && !emergencyStop)
+  {
+    turnKp = 0.2f * ku;
+    turnKi = 0.4f * ku / tu;
+    turnKd = 0.0667f * ku * tu;
+    float relayCost = timeTuneTurns();
+    if (tuneBetter(relayCost, best))
+    {
+      best = relayCost;
+    }
+    else
+    {
+      turnKp = oldKp;
+      turnKi = oldKi;
+      turnKd = oldKd;
+    }
+  }
+
+  searchGains(best, 1.6f);
+  searchGains(best, 1.25f);
+
+  if (emergencyStop)
+  {
+    turnKp = oldKp;
+    turnKi = oldKi;
+    turnKd = oldKd;
+    return;
+  }
+
+  bool saved = saveTurnGains();
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("kp %.3f ki %.3f", (double)turnKp, (double)turnKi);
+  Brain.Screen.newLine();
+  Brain.Screen.print("kd %.3f", (double)turnKd);
+  Brain.Screen.newLine();
+  Brain.Screen.print("settle %d -> %d ms", (int)oldCost, (int)best);
+  Brain.Screen.newLine();
+  Brain.Screen.print(saved ? "saved to sd card" : "not saved, no sd card");
+}
+
+// ---------------------- settle time benchmark
+// build with -DBENCHMARK_SETTLE and MODE_DEAL turns once around the table for
+// every player count from 2 to 10 instead of dealing, then shows the mean
+// turn and settle time (ms after the profile ended) per player count, and
+// how long a small correction takes.
+#ifdef BENCHMARK_SETTLE
+const int   NUM_NUDGES = 20;   // then this many small turns back and forth
+const float NUDGE_DEG  = 3.0f;
+
+void benchmarkSettle()
+{
+  uint32_t turnAvg[11];
+  uint32_t settleAvg[11];
+
+  for (int n = 2; n <= 10 && !emergencyStop; n++)
+  {
+    rotateToHeadingPID(0);
+    wait(300, msec);
+
+    uint32_t turnSum = 0;
+    uint32_t settleSum = 0;
+    for (int seat = 1; seat <= n && !emergencyStop; seat++)
+    {
+      rotateToHeadingPID(360.0f / n * (seat % n));
+      turnSum += lastTurnMs;
+      settleSum += lastSettleMs;
+      wait(200, msec);
+    }
+    turnAvg[n] = turnSum / n;
+    settleAvg[n] = settleSum / n;
+
+    Brain.Screen.clearScreen();
+    Brain.Screen.setCursor(1,1);
+    Brain.Screen.print("%d players: %lu/%lu ms", n,
+                       (unsigned long)turnAvg[n], (unsigned long)settleAvg[n]);
+  }
+  if (emergencyStop) return;
+
+  // small corrections from rest, where the deadband matters most
+  rotateToHeadingPID(0);
+  wait(300, msec);
+  uint32_t nudgeSum = 0;
+  for (int i = 0; i < NUM_NUDGES && !emergencyStop; i++)
+  {
+    rotateToHeadingPID(i % 2 == 0 ? NUDGE_DEG : 0.0f);
+    nudgeSum += lastTurnMs;
+    wait(200, msec);
+  }
+
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("turn/settle ms");
+  for (int n = 2; n <= 10; n++)
+  {
+    if (n % 2 == 0) Brain.Screen.newLine();
+    Brain.Screen.print("%d:%lu/%lu ", n,
+                       (unsigned long)turnAvg[n], (unsigned long)settleAvg[n]);
+  }
+  Brain.Screen.newLine();
+  Brain.Screen.print("%d deg nudge %lu ms", (int)NUDGE_DEG,
+                     (unsigned long)(nudgeSum / NUM_NUDGES));
+  Brain.Screen.newLine();
+  Brain.Screen.print("band cw %.1f ccw %.1f%%", (double)breakawayPower[0],
+                     (double)breakawayPower[1]);
+  wait(5, seconds);
+}
+#endif
+
+// ---------------------- control math benchmark
+// build with -DBENCHMARK_MATH to time one pid iteration + one color check,
+// old double version vs the float version. on the brain this counts cpu
+// cycles with the cortex-m4 DWT cycle counter. the simulator's clock is
+// virtual and stands still while we compute, so there it counts host ns
+// instead: only the ratio means anything on a pc's fpu.
+#ifdef BENCHMARK_MATH
+#ifdef VexIQ2
+volatile uint32_t *const DWT_CTRL   = (volatile uint32_t *)0xE0001000;
+volatile uint32_t *const DWT_CYCCNT = (volatile uint32_t *)0xE0001004;
+volatile uint32_t *const DEMCR      = (volatile uint32_t *)0xE000EDFC;
+
+uint32_t benchTicks() { return *DWT_CYCCNT; }
+
+void benchStart()
+{
+  *DEMCR |= (1u << 24);   // enable trace
+  *DWT_CYCCNT = 0;
+  *DWT_CTRL |= 1u;        // enable cycle counter
+}
+#else
+#include <time.h>
+
+uint32_t benchTicks()
+{
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint32_t)(ts.tv_sec * 1000000000ull + ts.tv_nsec);
+}
+void benchStart() {}
+#endif
+
+// inputs/outputs are volatile so the compiler can't fold the loop away
+volatile double benchHeadingD = 123.4;
+volatile float  benchHeadingF = 123.4f;
+volatile double benchOutD = 0.0;
+volatile float  benchOutF = 0.0f;
+
+// old double math (same as v11 before the float change)
+double clampDouble(double power, double minPower, double maxPower)
+{
+  double temp = fabs(power);
+  if (temp < minPower) temp = minPower;
+  if (temp > maxPower) temp = maxPower;
+  return copysign(temp, power);
+}
+
+double convertAngleDouble(double angle)
+{
+  while (angle > 180.0) angle -= 360.0;
+  while (angle < -180.0) angle += 360.0;
+  return angle;
+}
+
+void benchmarkControlMath()
+{
+  const int iterations = 2000;
+  benchStart();
+
+  // double: one pid step + classify
+  double integral = 0.0, prevError = 0.0;
+  uint32_t start = benchTicks();
+  for (int i = 0; i < iterations; i++)
+  {
+    double error = convertAngleDouble(90.0 - benchHeadingD);
+    if (fabs(error) < 20.0) integral += error * (15/1000.0);
+    double derivative = (error - prevError) / (15/1000.0);
+    double u = 1.25*error + 0.02*integral + 0.15*derivative;
+    prevError = error;
+    double hue = benchHeadingD;
+    int pile = (hue >= 0 && hue < 20) ? 0 : (hue >= 20 && hue < 45) ? 1
+             : (hue >= 215 && hue < 360) ? 2 : (hue >= 45 && hue <= 150) ? 3 : 5;
+    benchOutD = clampDouble(u, 7.0, 70.0) + clampDouble(-u, 7.0, 70.0) + pile;
+  }
+  uint32_t doubleTicks = benchTicks() - start;
+
+  // float: same work through the real functions
+  float integralF = 0.0f, prevErrorF = 0.0f;
+  start = benchTicks();
+  for (int i = 0; i < iterations; i++)
+  {
+    float error = convertAngle(90.0f - benchHeadingF);
+    if (fabsf(error) < 20.0f) integralF += error * (15/1000.0f);
+    float derivative = (error - prevErrorF) / (15/1000.0f);
+    float u = 1.25f*error + 0.02f*integralF + 0.15f*derivative;
+    prevErrorF = error;
+    float hue = benchHeadingF;
+    int pile = (hue >= 0 && hue < 20) ? 0 : (hue >= 20 && hue < 45) ? 1
+             : (hue >= 215 && hue < 360) ? 2 : (hue >= 45 && hue <= 150) ? 3 : 5;
+    benchOutF = clamp(u, 7.0f, 70.0f) + clamp(-u, 7.0f, 70.0f) + pile;
+  }
+  uint32_t floatTicks = benchTicks() - start;
+
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("ticks per iteration");
+  Brain.Screen.newLine();
+  Brain.Screen.print("double: %d", (int)(doubleTicks / iterations));
+  Brain.Screen.newLine();
+  Brain.Screen.print("float:  %d", (int)(floatTicks / iterations));
+  Brain.Screen.newLine();
+  Brain.Screen.print("press check");
+  clearInput();
+  waitForCheck();
+}
+#endif
 
+// shown once the program has backed out of whatever was running when the
+// emergency stop was pressed. check resets it and goes back to the menu
+void handleEmergencyStop()
+{
+  Brain.Screen.clearScreen();
+  Brain.Screen.setCursor(1,1);
+  Brain.Screen.print("EMERGENCY STOP!");
+  Brain.Screen.newLine();
+  Brain.Screen.print("press check to reset");
+
+  clearInput();
+  waitForCheck();
+
+  strokeRunning = false;
+  emergencyStop = false;
+  TouchLED.setColor(color::green);
 }
 
 // ---------------------- main: random shuffle dealing ----------------------
@@ -681,9 +3445,22 @@ int main()
 {
 	vexcodeInit();
 	configureAllSensors();
+	thread retractThread(retractTask); // background retract, see startRetract()
+	thread estopThread(estopTask);     // emergency stop backup, see estopTask()
+	estopThread.setPriority(thread::threadPriorityHigh);
+	startFlightLog();
+	loadTurnGains();
+	loadColorCalibration();
+	thread logThread(logTask);         // sd writes for the flight recorder
+	logThread.setPriority(thread::threadPriorityLow);
+	setupInput();
 
 	srand(Brain.Timer.time(msec));
 
+#ifdef BENCHMARK_MATH
+  benchmarkControlMath();
+#endif
+
   // while (true) {
   //   wait(1,seconds);
 
@@ -699,9 +3476,19 @@ int main()
   int cardsPer = 0;
   while(mode != MODE_EXIT)
   {
+    resetPhaseTimes(); // timing covers everything until the next mode menu
+
     // displaying selected mode/asking for values
     Brain.Screen.clearScreen();
 	  Brain.Screen.setCursor(1,1);
+#ifdef BENCHMARK_SETTLE
+	  if (mode == MODE_DEAL)
+    {
+		  Brain.Screen.print("settle benchmark");
+      wait(1,seconds);
+    }
+    else
+#endif
 	  if (mode == MODE_DEAL)
     {
 		  Brain.Screen.print("deal selected");
@@ -747,9 +3534,29 @@ int main()
 		  Brain.Screen.print("sort selected");
       wait(1, seconds);
 	  }
+    else if (mode == MODE_TUNE)
+    {
+		  Brain.Screen.print("autotune selected");
+      Brain.Screen.newLine();
+		  Brain.Screen.print("clear space to turn");
+      wait(2, seconds);
+	  }
+    else if (mode == MODE_CALIBRATE)
+    {
+		  Brain.Screen.print("color cal selected");
+      wait(1, seconds);
+	  }
 
 
     // looping code
+	  operationRunning = true;
+#ifdef BENCHMARK_SETTLE
+	  if (mode == MODE_DEAL)
+    {
+      benchmarkSettle(); // sweeps 2-10 players instead of dealing
+    }
+    else
+#endif
 	  if (mode == MODE_DEAL)
     {
 
@@ -769,15 +3576,14 @@ int main()
                 Brain.Screen.print("put in cards and");
                 Brain.Screen.newLine();
                 Brain.Screen.print("press check to continue.");
-                while(!Brain.buttonCheck.pressing())
-                {}
-                while(Brain.buttonCheck.pressing())
-                {}
+                clearInput();
+                waitForCheck();
                 cyanCheck = getCardColor();
             }
 			  cycle++;
 
 			  // deals cards to each player, based on how many cards per player
+			  resetSeatAccuracy();
 			  wait(100, msec);
 			  Brain.Screen.clearScreen();
 			  Brain.Screen.setCursor(1,1);
@@ -785,15 +3591,30 @@ int main()
               Brain.Screen.newLine();
 			  Brain.Screen.print("cycle %d", cycle);
 
-			  for (int i = 0; i < cardsPer; i++)
+			  if (sweepDealing && players <= SWEEP_MAX_PLAYERS)
+        {
+          sweepDeal(players, cardsPer); // deals without stopping at seats
+        }
+        else
         {
-				  for (int j = 0; j < players; j++)
+          int extra[MAX_SEATS] = {0}; // cards a double feed gave early
+			    for (int i = 0; i < cardsPer && !emergencyStop; i++)
           {
-					  double heading = 360.0 / players * j;
-					  // "divides" 360 degrees into angles based on how many players, then multiplies by j for the current player
-					  dealCardsToPosition(heading, 1);
-				  }
-			  }
+				    for (int j = 0; j < players && !emergencyStop; j++)
+            {
+              if (extra[j] > 0)
+              {
+                extra[j]--;
+                continue;
+              }
+					    float heading = 360.0f / players * j;
+					    // "divides" 360 degrees into angles based on how many players, then multiplies by j for the current player
+					    int dealt = dealCardsToPosition(heading, 1);
+              if (dealt > 1) extra[j] += dealt - 1;
+				    }
+			    }
+        }
+			  if (emergencyStop) break;
 
 			  Brain.Screen.clearScreen();
 			  Brain.Screen.setCursor(1,1);
@@ -803,6 +3624,10 @@ int main()
 
 			  wait(1, seconds);
 
+			  showSeatAccuracy();
+			  wait(2, seconds);
+			  showPhaseTimes();
+
 			  // ask user if they want another cycle
 			  keepDealing = askContinue(players);
         
@@ -832,16 +3657,15 @@ int main()
                 Brain.Screen.print("put in cards and");
                 Brain.Screen.newLine();
                 Brain.Screen.print("press check to continue.");
-                while(!Brain.buttonCheck.pressing())
-                {}
-                while(Brain.buttonCheck.pressing())
-                {}
+                clearInput();
+                waitForCheck();
                 cyanCheck = getCardColor();
             }
             
 			  cycle++;
 
 			  // runs shuffle dealing function
+			  resetSeatAccuracy();
 			  wait(1, seconds);
 			  Brain.Screen.clearScreen();
 			  Brain.Screen.setCursor(1,1);
@@ -850,6 +3674,7 @@ int main()
 			  Brain.Screen.print("cycle %d", cycle);
 
 			  shuffleDeal(players, cardsPer);
+			  if (emergencyStop) break;
 
 			  Brain.Screen.clearScreen();
 			  Brain.Screen.setCursor(1,1);
@@ -859,6 +3684,10 @@ int main()
 
 			  wait(1, seconds);
 
+			  showSeatAccuracy();
+			  wait(2, seconds);
+			  showPhaseTimes();
+
 			  // ask user if they want another cycle
 			  keepDealing = askContinue(players);
 
@@ -881,18 +3710,37 @@ int main()
                 Brain.Screen.print("put in cards and");
                 Brain.Screen.newLine();
                 Brain.Screen.print("press check to continue.");
-                while(!Brain.buttonCheck.pressing())
-                {}
-                while(Brain.buttonCheck.pressing())
-                {}
+                clearInput();
+                waitForCheck();
                 cyanCheck = getCardColor();
             }
 		  // runs colorSort()
 		  wait(1, seconds);
 		  colorSort();
+		  if (!emergencyStop)
+		  {
+		    wait(1, seconds);
+		    showPhaseTimes();
+		  }
 	  }
+    else if (mode == MODE_TUNE)
+    {
+      autotuneTurns();
+    }
+    else if (mode == MODE_CALIBRATE)
+    {
+      calibrateColors();
+    }
+	  operationRunning = false;
 
-	  wait(5,seconds);
+	  if (emergencyStop)
+	  {
+	    handleEmergencyStop();
+	  }
+	  else
+	  {
+	    wait(5,seconds);
+	  }
 	  mode = selectMode();
   }
   Brain.Screen.clearScreen();